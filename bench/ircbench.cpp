@@ -0,0 +1,382 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Load generator for ircserv: opens many loopback connections, runs the
+// NICK/PASS/USER/JOIN/PRIVMSG flow and measures end-to-end delivery
+// latency from timestamps embedded in every message.
+
+struct BenchConfig {
+	std::string host;
+	int port;
+	std::string password;
+	int clients;
+	int messages;     // PRIVMSGs sent by every client
+	int channel_size; // Members per channel in the "channels" scenario
+	int rate;         // Messages per second per client, 0 = as fast as possible
+	int payload;      // Extra bytes of padding per message
+	int timeout;      // Seconds to wait for each phase
+	std::string scenario; // channels, huge or dm
+
+	BenchConfig()
+		: host("127.0.0.1"), port(0), clients(1000), messages(20), channel_size(10),
+		  rate(0), payload(32), timeout(30), scenario("channels") {}
+};
+
+enum Phase { CONNECTING, REGISTERING, JOINING, READY, DEAD };
+
+struct BenchClient {
+	int fd;
+	Phase phase;
+	std::string nickname;
+	std::string target; // Channel or nickname to send to
+	std::string in;
+	std::string out;
+	int sent;
+	long long next_send;
+};
+
+static long long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static std::string itos(long long n) {
+	std::ostringstream oss;
+	oss << n;
+	return oss.str();
+}
+
+static bool parse_option(BenchConfig &config, const std::string &option) {
+	size_t eq = option.find('=');
+	if (option.compare(0, 2, "--") != 0 || eq == std::string::npos)
+		return false;
+	std::string key = option.substr(2, eq - 2);
+	std::string value = option.substr(eq + 1);
+	int number = std::atoi(value.c_str());
+
+	if (key == "scenario" && (value == "channels" || value == "huge" || value == "dm"))
+		config.scenario = value;
+	else if (key == "host")
+		config.host = value;
+	else if (key == "clients" && number > 1)
+		config.clients = number;
+	else if (key == "messages" && number > 0)
+		config.messages = number;
+	else if (key == "channel-size" && number > 1)
+		config.channel_size = number;
+	else if (key == "rate" && number >= 0)
+		config.rate = number;
+	else if (key == "payload" && number >= 0 && number <= 400)
+		config.payload = number;
+	else if (key == "timeout" && number > 0)
+		config.timeout = number;
+	else
+		return false;
+	return true;
+}
+
+class Bench {
+	private:
+		BenchConfig config;
+		std::vector<BenchClient> clients;
+		std::vector<struct pollfd> fds;
+		std::vector<long long> latencies; // Nanoseconds
+		long long expected;   // Deliveries the server owes us
+		long long delivered;
+		long long bytes_in;
+
+		void raise_fd_limit() {
+			struct rlimit limit;
+			if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+				limit.rlim_cur = limit.rlim_max;
+				setrlimit(RLIMIT_NOFILE, &limit);
+			}
+		}
+
+		bool open_connection(BenchClient &client, const struct sockaddr_in &addr) {
+			client.fd = socket(AF_INET, SOCK_STREAM, 0);
+			if (client.fd < 0)
+				return false;
+			fcntl(client.fd, F_SETFL, O_NONBLOCK);
+			int one = 1;
+			setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			if (connect(client.fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+				close(client.fd);
+				return false;
+			}
+			client.phase = CONNECTING;
+			return true;
+		}
+
+		// Dead clients sort after READY, so they never hold up a phase
+		void fail(BenchClient &client, const char *why) {
+			if (client.phase == DEAD)
+				return;
+			std::cerr << "ircbench: " << client.nickname << ": " << why << std::endl;
+			client.phase = DEAD;
+		}
+
+		void on_line(BenchClient &client, const std::string &line) {
+			if (client.phase == REGISTERING && line.compare(0, 22, "User information set. ") == 0) {
+				client.phase = (config.scenario == "dm") ? READY : JOINING;
+				if (client.phase == JOINING)
+					client.out += "JOIN " + client.target + "\r\n";
+				return;
+			}
+			if (client.phase == JOINING && line.compare(0, 16, "Joined channel: ") == 0) {
+				client.phase = READY;
+				return;
+			}
+			// "<nick>: t=<ns> ..." from a channel, "<nick> (private): t=<ns> ..." for a DM
+			size_t stamp = line.find(": t=");
+			if (stamp == std::string::npos || line.compare(0, 5, "You: ") == 0)
+				return;
+			long long sent_at = std::atoll(line.c_str() + stamp + 4);
+			latencies.push_back(now_ns() - sent_at);
+			delivered++;
+		}
+
+		void read_client(BenchClient &client) {
+			char buffer[65536];
+			while (true) {
+				ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+				if (n == 0) {
+					fail(client, "connection closed by server");
+					return;
+				}
+				if (n < 0) {
+					if (errno != EAGAIN && errno != EWOULDBLOCK)
+						fail(client, "read error");
+					return;
+				}
+				bytes_in += n;
+				client.in.append(buffer, n);
+				size_t start = 0, end;
+				while ((end = client.in.find('\n', start)) != std::string::npos) {
+					on_line(client, client.in.substr(start, end - start));
+					start = end + 1;
+				}
+				client.in.erase(0, start);
+			}
+		}
+
+		void write_client(BenchClient &client) {
+			while (!client.out.empty()) {
+				ssize_t n = send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+				if (n < 0) {
+					if (errno != EAGAIN && errno != EWOULDBLOCK)
+						fail(client, "write error");
+					return;
+				}
+				client.out.erase(0, n);
+			}
+		}
+
+		// Drives every socket once, returns when something happened or after 1 ms
+		void turn() {
+			for (size_t i = 0; i < clients.size(); i++) {
+				fds[i].fd = clients[i].phase == DEAD ? -1 : clients[i].fd;
+				fds[i].events = POLLIN;
+				if (clients[i].phase == CONNECTING || !clients[i].out.empty())
+					fds[i].events |= POLLOUT;
+				fds[i].revents = 0;
+			}
+			if (poll(&fds[0], fds.size(), 1) <= 0)
+				return;
+			for (size_t i = 0; i < clients.size(); i++) {
+				BenchClient &client = clients[i];
+				if (!fds[i].revents || client.phase == DEAD)
+					continue;
+				if (client.phase == CONNECTING && (fds[i].revents & (POLLOUT | POLLERR | POLLHUP))) {
+					int error = 0;
+					socklen_t length = sizeof(error);
+					getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+					if (error) {
+						fail(client, "connect failed");
+						continue;
+					}
+					client.phase = REGISTERING;
+					client.out += "NICK " + client.nickname + "\r\nPASS " + config.password
+						+ "\r\nUSER " + client.nickname + " bench bench :ircbench\r\n";
+				}
+				if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+					read_client(client);
+				if (client.phase != DEAD && !client.out.empty())
+					write_client(client);
+			}
+		}
+
+		int behind(Phase phase) const {
+			int count = 0;
+			for (size_t i = 0; i < clients.size(); i++)
+				count += clients[i].phase < phase;
+			return count;
+		}
+
+		// Runs until every live client reached `phase`
+		bool wait_phase(const char *name, Phase phase, long long started) {
+			long long deadline = started + (long long)config.timeout * 1000000000LL;
+			int waiting;
+			while ((waiting = behind(phase)) > 0 && now_ns() < deadline)
+				turn();
+			double seconds = (now_ns() - started) / 1e9;
+			std::cout << std::left << std::setw(14) << name << std::right << std::fixed << std::setprecision(3)
+				<< seconds << " s";
+			if (waiting > 0) {
+				std::cout << "  (" << waiting << " clients did not finish)" << std::endl;
+				return false;
+			}
+			std::cout << "  " << std::setprecision(0) << clients.size() / seconds << " clients/s" << std::endl;
+			return true;
+		}
+
+		void assign_targets() {
+			for (size_t i = 0; i < clients.size(); i++) {
+				BenchClient &client = clients[i];
+				client.nickname = "bench" + itos(i);
+				client.phase = DEAD;
+				client.sent = 0;
+				client.next_send = 0;
+				if (config.scenario == "huge")
+					client.target = "#bench";
+				else if (config.scenario == "channels")
+					client.target = "#bench" + itos(i / config.channel_size);
+				else
+					client.target = "bench" + itos((i * 7919 + 1) % clients.size()); // Spread DMs around
+			}
+
+			// Each channel message reaches every other member, a DM exactly one client
+			expected = 0;
+			for (size_t i = 0; i < clients.size(); i++) {
+				long long reach = 1;
+				if (config.scenario == "huge")
+					reach = clients.size() - 1;
+				else if (config.scenario == "channels") {
+					size_t first = (i / config.channel_size) * config.channel_size;
+					reach = std::min(clients.size(), first + config.channel_size) - first - 1;
+				}
+				expected += reach * config.messages;
+			}
+		}
+
+		void send_messages() {
+			std::string padding(config.payload, 'x');
+			long long interval = config.rate ? 1000000000LL / config.rate : 0;
+			long long deadline = now_ns() + (long long)config.timeout * 1000000000LL;
+			long long started = now_ns();
+			long long total = (long long)config.messages * clients.size();
+			long long queued = 0;
+
+			while ((queued < total || delivered < expected) && now_ns() < deadline) {
+				long long now = now_ns();
+				for (size_t i = 0; i < clients.size(); i++) {
+					BenchClient &client = clients[i];
+					// Keep the per-client backlog small so latency isn't just our own queueing
+					while (client.phase == READY && client.sent < config.messages
+							&& client.next_send <= now && client.out.size() < 4096) {
+						client.out += "PRIVMSG " + client.target + " :t=" + itos(now_ns()) + " "
+							+ client.nickname + " " + padding + "\r\n";
+						client.sent++;
+						client.next_send = interval ? now + interval : 0;
+						queued++;
+					}
+				}
+				turn();
+			}
+
+			double seconds = (now_ns() - started) / 1e9;
+			std::cout << std::fixed << std::setprecision(0)
+				<< "sent          " << queued << " msgs, " << queued / seconds << " msgs/s" << std::endl
+				<< "delivered     " << delivered << "/" << expected << " msgs, "
+				<< delivered / seconds << " msgs/s, " << bytes_in / seconds / 1048576 << " MiB/s" << std::endl;
+		}
+
+		void report_latency() {
+			if (latencies.empty())
+				return;
+			std::sort(latencies.begin(), latencies.end());
+			const double points[] = { 0.5, 0.99, 0.999, 1.0 };
+			const char *names[] = { "p50", "p99", "p999", "max" };
+			std::cout << "latency      ";
+			for (int i = 0; i < 4; i++) {
+				size_t index = std::min(latencies.size() - 1, (size_t)(points[i] * latencies.size()));
+				std::cout << " " << names[i] << "=" << std::setprecision(1) << latencies[index] / 1000.0 << "us";
+			}
+			std::cout << std::endl;
+		}
+
+	public:
+		explicit Bench(const BenchConfig &config)
+			: config(config), clients(config.clients), fds(config.clients),
+			  expected(0), delivered(0), bytes_in(0) {}
+
+		int run() {
+			raise_fd_limit();
+			assign_targets();
+
+			struct sockaddr_in addr;
+			std::memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(config.port);
+			if (inet_pton(AF_INET, config.host.c_str(), &addr.sin_addr) != 1) {
+				std::cerr << "ircbench: invalid host " << config.host << std::endl;
+				return 1;
+			}
+
+			std::cout << "scenario " << config.scenario << ", " << config.clients << " clients, "
+				<< config.messages << " messages each" << std::endl;
+
+			long long started = now_ns();
+			for (size_t i = 0; i < clients.size(); i++) {
+				if (!open_connection(clients[i], addr)) {
+					std::cerr << "ircbench: cannot open connection " << i << ": " << strerror(errno) << std::endl;
+					return 1;
+				}
+			}
+			if (!wait_phase("connect+auth", JOINING, started))
+				return 1;
+			if (config.scenario != "dm" && !wait_phase("join", READY, now_ns()))
+				return 1;
+
+			send_messages();
+			report_latency();
+			for (size_t i = 0; i < clients.size(); i++)
+				close(clients[i].fd);
+			return delivered == expected ? 0 : 1;
+		}
+};
+
+int main(int argc, char *argv[]) {
+	BenchConfig config;
+	bool valid_options = argc >= 3;
+	for (int i = 3; i < argc; i++)
+		valid_options = valid_options && parse_option(config, argv[i]);
+	if (!valid_options || std::atoi(argv[1]) <= 0) {
+		std::cerr << "Usage: ./ircbench <port> <password> [--scenario=channels|huge|dm] [--clients=N]"
+			<< " [--messages=N] [--channel-size=N] [--rate=<msgs/s per client>] [--payload=<bytes>]"
+			<< " [--timeout=<s>] [--host=<ipv4>]" << std::endl;
+		return 1;
+	}
+	config.port = std::atoi(argv[1]);
+	config.password = argv[2];
+
+	Bench bench(config);
+	return bench.run();
+}
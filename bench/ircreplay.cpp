@@ -0,0 +1,444 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../capture.hpp"
+
+// Replays a trace written by `ircserv --capture=<path>` against a server,
+// at the recorded pace or as fast as it will go, and digests what every
+// connection got back. Saving the digests of a known-good build and
+// comparing a later run against them shows which sessions diverged.
+//
+// Digests ignore the order of lines, since a connection's output mixes
+// other sessions' traffic in whatever order the workers ran it. Output
+// that depends on the clock (STATS, PING tokens, history timestamps)
+// diverges between any two runs. Replaying --fast can reorder what
+// separate connections did, so compare runs made at the same pace.
+
+struct ReplayConfig {
+	std::string host;
+	int port;
+	std::string password;
+	std::string oper_password; // Put back into redacted OPER lines
+	std::string trace;
+	std::string save;     // Digests of this run go here
+	std::string compare;  // Digests of an earlier run to check against
+	bool fast;            // Ignore the recorded timing
+	int timeout;          // Seconds
+	int quiet;            // Milliseconds without input that end the drain
+
+	ReplayConfig() : host("127.0.0.1"), port(0), fast(false), timeout(60), quiet(500) {}
+};
+
+struct Record {
+	unsigned long long stamp; // Nanoseconds since the capture opened
+	unsigned connection;
+	int event;
+	std::string line;
+
+	bool operator<(const Record &other) const {
+		return stamp < other.stamp;
+	}
+};
+
+struct ReplayClient {
+	unsigned id;
+	int fd;
+	bool connecting;
+	bool closing;  // The recorded client went away, hang up once `out` is sent
+	bool finished; // The server closed or the connection failed
+	std::string in;
+	std::string out;
+	unsigned long long lines;
+	unsigned long long digest; // Sum of every line's hash
+};
+
+static long long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// FNV-1a, 64 bits so summing the hashes of many lines rarely collides
+static unsigned long long hash_line(const char *data, size_t length) {
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static bool parse_option(ReplayConfig &config, const std::string &option) {
+	if (option == "--fast") {
+		config.fast = true;
+		return true;
+	}
+	size_t eq = option.find('=');
+	if (option.compare(0, 2, "--") != 0 || eq == std::string::npos)
+		return false;
+	std::string key = option.substr(2, eq - 2);
+	std::string value = option.substr(eq + 1);
+	int number = std::atoi(value.c_str());
+
+	if (key == "host")
+		config.host = value;
+	else if (key == "save" && !value.empty())
+		config.save = value;
+	else if (key == "compare" && !value.empty())
+		config.compare = value;
+	else if (key == "oper-password")
+		config.oper_password = value;
+	else if (key == "timeout" && number > 0)
+		config.timeout = number;
+	else if (key == "quiet" && number > 0)
+		config.quiet = number;
+	else
+		return false;
+	return true;
+}
+
+// Reads every record, sorted by time: workers append their batches
+// whole, so the file is only in order per connection
+static bool load_trace(const std::string &path, std::vector<Record> &records) {
+	std::ifstream file(path.c_str(), std::ios::binary);
+	if (!file)
+		return false;
+	std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	uint32_t version = 0;
+	if (bytes.size() < 12 || bytes.compare(0, 8, CAPTURE_MAGIC) != 0)
+		return false;
+	std::memcpy(&version, bytes.data() + 8, sizeof(version));
+	if (version != CAPTURE_VERSION)
+		return false;
+
+	const size_t header = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint16_t);
+	size_t offset = 12;
+	while (offset + header <= bytes.size()) {
+		uint64_t stamp;
+		uint32_t connection;
+		uint8_t event;
+		uint16_t length;
+		const char *at = bytes.data() + offset;
+		std::memcpy(&stamp, at, sizeof(stamp));
+		std::memcpy(&connection, at + 8, sizeof(connection));
+		std::memcpy(&event, at + 12, sizeof(event));
+		std::memcpy(&length, at + 13, sizeof(length));
+		if (offset + header + length > bytes.size())
+			break; // Cut short by a crash, keep what is whole
+		Record record;
+		record.stamp = stamp;
+		record.connection = connection;
+		record.event = event;
+		record.line.assign(at + header, length);
+		records.push_back(record);
+		offset += header + length;
+	}
+	std::stable_sort(records.begin(), records.end());
+	return true;
+}
+
+class Replay {
+	private:
+		ReplayConfig config;
+		std::vector<Record> records;
+		std::vector<ReplayClient> clients;
+		std::map<unsigned, size_t> by_id; // Trace connection -> clients index
+		std::vector<struct pollfd> fds;
+		struct sockaddr_in addr;
+		long long lines_sent;
+		long long bytes_in;
+		long long last_input; // now_ns() of the last bytes received
+
+		void raise_fd_limit() {
+			struct rlimit limit;
+			if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+				limit.rlim_cur = limit.rlim_max;
+				setrlimit(RLIMIT_NOFILE, &limit);
+			}
+		}
+
+		void open_connection(unsigned id) {
+			ReplayClient client;
+			client.id = id;
+			client.connecting = true;
+			client.closing = false;
+			client.finished = false;
+			client.lines = 0;
+			client.digest = 0;
+			client.fd = socket(AF_INET, SOCK_STREAM, 0);
+			if (client.fd >= 0) {
+				fcntl(client.fd, F_SETFL, O_NONBLOCK);
+				int one = 1;
+				setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				if (connect(client.fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+					close(client.fd);
+					client.fd = -1;
+				}
+			}
+			if (client.fd < 0) {
+				std::cerr << "ircreplay: connection " << id << ": " << strerror(errno) << std::endl;
+				client.finished = true;
+			}
+			by_id[id] = clients.size();
+			clients.push_back(client);
+		}
+
+		// Redacted passwords are put back before the line goes out
+		std::string restore(const std::string &line) const {
+			if (line == "PASS *")
+				return "PASS " + config.password;
+			if (line.compare(0, 5, "OPER ") == 0 && line.size() > 7 && line.compare(line.size() - 2, 2, " *") == 0)
+				return line.substr(0, line.size() - 1) + config.oper_password;
+			return line;
+		}
+
+		void dispatch(const Record &record) {
+			if (record.event == CAPTURE_CONNECT) {
+				open_connection(record.connection);
+				return;
+			}
+			std::map<unsigned, size_t>::iterator it = by_id.find(record.connection);
+			if (it == by_id.end())
+				return; // Its CONNECT was not in the trace
+			ReplayClient &client = clients[it->second];
+			if (record.event == CAPTURE_CLOSE)
+				client.closing = true;
+			else if (record.event == CAPTURE_LINE && !client.closing) {
+				client.out += restore(record.line) + "\r\n";
+				lines_sent++;
+			}
+		}
+
+		void finish(ReplayClient &client) {
+			if (client.finished)
+				return;
+			client.finished = true;
+			close(client.fd);
+		}
+
+		void read_client(ReplayClient &client) {
+			char buffer[65536];
+			while (true) {
+				ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+				if (n <= 0) {
+					if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+						finish(client);
+					return;
+				}
+				bytes_in += n;
+				last_input = now_ns();
+				client.in.append(buffer, n);
+				size_t start = 0, end;
+				while ((end = client.in.find('\n', start)) != std::string::npos) {
+					client.digest += hash_line(client.in.data() + start, end - start);
+					client.lines++;
+					start = end + 1;
+				}
+				client.in.erase(0, start);
+			}
+		}
+
+		void write_client(ReplayClient &client) {
+			while (!client.out.empty()) {
+				ssize_t n = send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+				if (n < 0) {
+					if (errno != EAGAIN && errno != EWOULDBLOCK)
+						finish(client);
+					return;
+				}
+				client.out.erase(0, n);
+			}
+			// Half-close, the server's last words still count
+			if (client.closing)
+				shutdown(client.fd, SHUT_WR);
+		}
+
+		// Drives every socket once, waits at most `wait` ms for something to happen
+		void turn(int wait) {
+			fds.resize(clients.size());
+			for (size_t i = 0; i < clients.size(); i++) {
+				fds[i].fd = clients[i].finished ? -1 : clients[i].fd;
+				fds[i].events = POLLIN;
+				if (clients[i].connecting || !clients[i].out.empty())
+					fds[i].events |= POLLOUT;
+				fds[i].revents = 0;
+			}
+			if (poll(fds.empty() ? NULL : &fds[0], fds.size(), wait) <= 0)
+				return;
+			for (size_t i = 0; i < clients.size(); i++) {
+				ReplayClient &client = clients[i];
+				if (!fds[i].revents || client.finished)
+					continue;
+				if (client.connecting && (fds[i].revents & (POLLOUT | POLLERR | POLLHUP))) {
+					int error = 0;
+					socklen_t length = sizeof(error);
+					getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+					if (error) {
+						std::cerr << "ircreplay: connection " << client.id << ": connect failed" << std::endl;
+						finish(client);
+						continue;
+					}
+					client.connecting = false;
+				}
+				if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+					read_client(client);
+				if (!client.finished && !client.connecting && (!client.out.empty() || client.closing))
+					write_client(client);
+			}
+		}
+
+		bool all_finished() const {
+			for (size_t i = 0; i < clients.size(); i++) {
+				if (!clients[i].finished)
+					return false;
+			}
+			return true;
+		}
+
+		// Still-open sessions end when the server has been quiet for a while
+		void drain(long long deadline) {
+			long long quiet = (long long)config.quiet * 1000000LL;
+			while (!all_finished() && now_ns() < deadline && now_ns() - last_input < quiet)
+				turn(10);
+			for (size_t i = 0; i < clients.size(); i++)
+				finish(clients[i]);
+		}
+
+		bool save_digests() const {
+			std::ofstream file(config.save.c_str());
+			for (size_t i = 0; i < clients.size(); i++)
+				file << clients[i].id << " " << clients[i].lines << " " << clients[i].digest << "\n";
+			return (bool)file;
+		}
+
+		// Returns the number of connections that got something else back
+		int compare_digests() const {
+			std::ifstream file(config.compare.c_str());
+			if (!file) {
+				std::cerr << "ircreplay: cannot read " << config.compare << std::endl;
+				return -1;
+			}
+			std::map<unsigned, std::pair<unsigned long long, unsigned long long> > expected;
+			unsigned id;
+			unsigned long long lines, digest;
+			while (file >> id >> lines >> digest)
+				expected[id] = std::make_pair(lines, digest);
+
+			int diverged = 0;
+			for (size_t i = 0; i < clients.size(); i++) {
+				const ReplayClient &client = clients[i];
+				std::map<unsigned, std::pair<unsigned long long, unsigned long long> >::const_iterator it
+					= expected.find(client.id);
+				if (it == expected.end()) {
+					std::cout << "connection " << client.id << ": not in " << config.compare << std::endl;
+					diverged++;
+				} else if (it->second.first != client.lines || it->second.second != client.digest) {
+					std::cout << "connection " << client.id << ": " << client.lines << " lines, expected "
+						<< it->second.first << (it->second.first == client.lines ? " (contents differ)" : "")
+						<< std::endl;
+					diverged++;
+				}
+			}
+			return diverged;
+		}
+
+	public:
+		explicit Replay(const ReplayConfig &config)
+			: config(config), lines_sent(0), bytes_in(0), last_input(0) {}
+
+		int run() {
+			raise_fd_limit();
+			if (!load_trace(config.trace, records)) {
+				std::cerr << "ircreplay: cannot read trace " << config.trace << std::endl;
+				return 1;
+			}
+			std::memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(config.port);
+			if (inet_pton(AF_INET, config.host.c_str(), &addr.sin_addr) != 1) {
+				std::cerr << "ircreplay: invalid host " << config.host << std::endl;
+				return 1;
+			}
+			std::cout << "trace " << config.trace << ", " << records.size() << " records, "
+				<< (config.fast ? "as fast as possible" : "recorded pace") << std::endl;
+
+			long long started = now_ns();
+			long long deadline = started + (long long)config.timeout * 1000000000LL;
+			unsigned long long first = records.empty() ? 0 : records[0].stamp;
+			size_t next = 0;
+			while (next < records.size() && now_ns() < deadline) {
+				long long elapsed = now_ns() - started;
+				while (next < records.size() && (config.fast || (long long)(records[next].stamp - first) <= elapsed))
+					dispatch(records[next++]);
+				int wait = 0;
+				if (!config.fast && next < records.size())
+					wait = std::min(1LL, (long long)(records[next].stamp - first - elapsed) / 1000000);
+				turn(wait);
+			}
+			double sending = (now_ns() - started) / 1e9;
+			last_input = now_ns();
+			drain(deadline);
+			double seconds = (now_ns() - started) / 1e9;
+
+			unsigned long long lines_in = 0;
+			for (size_t i = 0; i < clients.size(); i++)
+				lines_in += clients[i].lines;
+			std::cout << std::fixed << std::setprecision(3)
+				<< "replayed      " << clients.size() << " connections, " << lines_sent << " lines in "
+				<< sending << " s, " << std::setprecision(0) << lines_sent / sending << " lines/s" << std::endl
+				<< "received      " << lines_in << " lines, " << bytes_in << " bytes in " << std::setprecision(3)
+				<< seconds << " s" << std::endl;
+			if (next < records.size())
+				std::cout << "timed out with " << records.size() - next << " records left" << std::endl;
+
+			if (!config.save.empty() && !save_digests()) {
+				std::cerr << "ircreplay: cannot write " << config.save << std::endl;
+				return 1;
+			}
+			if (!config.compare.empty()) {
+				int diverged = compare_digests();
+				if (diverged < 0)
+					return 1;
+				std::cout << "diverged      " << diverged << "/" << clients.size() << " connections" << std::endl;
+				if (diverged > 0)
+					return 1;
+			}
+			return next < records.size() ? 1 : 0;
+		}
+};
+
+int main(int argc, char *argv[]) {
+	ReplayConfig config;
+	bool valid_options = argc >= 4;
+	for (int i = 4; i < argc; i++)
+		valid_options = valid_options && parse_option(config, argv[i]);
+	if (!valid_options || std::atoi(argv[1]) <= 0) {
+		std::cerr << "Usage: ./ircreplay <port> <password> <trace> [--fast] [--save=<file>] [--compare=<file>]"
+			<< " [--oper-password=<password>] [--timeout=<s>] [--quiet=<ms>] [--host=<ipv4>]" << std::endl;
+		return 1;
+	}
+	config.port = std::atoi(argv[1]);
+	config.password = argv[2];
+	config.trace = argv[3];
+
+	Replay replay(config);
+	return replay.run();
+}
@@ -0,0 +1,77 @@
+#ifndef BUFFER_HPP
+# define BUFFER_HPP
+
+# include <string>
+# include <cstddef>
+# include "string_view.hpp"
+
+# define MESSAGE_INLINE_SIZE 1024 // Room for everything taken from one input line
+
+// Immutable, reference-counted message bytes. A broadcast is rendered
+// once and every recipient's send queue points at the same block. The
+// count is atomic since blocks are handed to other workers' mailboxes.
+// Blocks come from the size-class pool.
+class SharedBuffer {
+	private:
+		size_t refs;
+		size_t length;
+
+		explicit SharedBuffer(size_t length);
+		SharedBuffer(const SharedBuffer &);
+		SharedBuffer &operator=(const SharedBuffer &);
+
+	public:
+		static SharedBuffer *create(const char *data, size_t length);
+
+		void retain();
+		void release();
+		const char *data() const;
+		size_t size() const;
+};
+
+// Owning handle, copying it only bumps the reference count
+class BufferRef {
+	private:
+		SharedBuffer *buffer;
+
+	public:
+		BufferRef();
+		explicit BufferRef(const std::string &message);
+		BufferRef(const char *data, size_t length);
+		explicit BufferRef(SharedBuffer *adopted);
+		BufferRef(const BufferRef &other);
+		BufferRef &operator=(const BufferRef &other);
+		~BufferRef();
+
+		const char *data() const;
+		size_t size() const;
+		bool empty() const;
+		SharedBuffer *share() const;
+};
+
+// Assembles a message from pieces and copies it once into a pooled block,
+// so rendering a reply takes no temporary strings. Messages too long for
+// the inline bytes spill into a string.
+class MessageBuilder {
+	private:
+		char bytes[MESSAGE_INLINE_SIZE];
+		size_t length;
+		std::string spill;
+
+		MessageBuilder(const MessageBuilder &);
+		MessageBuilder &operator=(const MessageBuilder &);
+
+		void append(const char *data, size_t size);
+
+	public:
+		MessageBuilder();
+
+		MessageBuilder &operator<<(const char *text);
+		MessageBuilder &operator<<(const std::string &text);
+		MessageBuilder &operator<<(const StringView &text);
+		const char *data() const;
+		size_t size() const;
+		BufferRef build() const;
+};
+
+#endif // BUFFER_HPP
@@ -0,0 +1,29 @@
+#ifndef CAPTURE_HPP
+# define CAPTURE_HPP
+
+# include <string>
+# include <cstddef>
+
+# define CAPTURE_MAGIC "IRCTRACE" // 8 bytes at the start of a trace, then a u32 version
+# define CAPTURE_VERSION 1
+# define CAPTURE_FLUSH_BYTES 65536 // A worker writes its records once this many pile up
+# define CAPTURE_FLUSH_MS 100      // or once they are this old
+
+enum CaptureEvent { CAPTURE_CONNECT, CAPTURE_LINE, CAPTURE_CLOSE };
+
+// Trace of inbound client traffic, replayed by bench/ircreplay.cpp. Each
+// record is, in host byte order:
+//   u64 ns since the capture opened, u32 connection, u8 event,
+//   u16 length, then the line without its CRLF
+// Connections are numbered from 1 in accept order, so a reused fd never
+// merges two sessions. Workers batch their records and append them
+// whole: the file is in order per connection, not across workers, and
+// the replayer sorts by time. Passwords are replaced with "*".
+bool capture_open(const std::string &path);
+void capture_close();
+bool capture_enabled();
+unsigned capture_connection();
+void capture_append(std::string &batch, unsigned connection, CaptureEvent event, const char *data, size_t length);
+void capture_write(std::string &batch);
+
+#endif // CAPTURE_HPP
@@ -0,0 +1,48 @@
+#ifndef CHANNEL_HPP
+# define CHANNEL_HPP
+
+# include <string>
+# include <vector>
+# include <map>
+# include <cstddef>
+# include "pool.hpp"
+# include "mask_list.hpp"
+# include "hash_table.hpp"
+# include "string_view.hpp"
+
+// Members, operators, modes and topic of one channel, reached with a
+// single hash of its name. Client slots are kept in sorted vectors:
+// compact, binary searched, and users on linked servers (the slots past
+// the fd range) sort last.
+struct Channel {
+	std::string name;
+	std::vector<int> members;
+	std::vector<int> operators; // A kicked operator keeps the status
+	bool invite_only;
+	bool topic_restricted;
+	std::string key;  // Empty when there is none
+	int user_limit;   // 0 when there is none
+	std::string topic;
+	MaskList bans;    // +b, can't join or speak
+	MaskList excepts; // +e, exempt from the bans
+	MaskList invites; // +I, may join while +i
+
+	explicit Channel(const std::string &name);
+
+	bool has_member(int client) const;
+	bool is_operator(int client) const;
+	bool add_member(int client);
+	bool remove_member(int client);
+	bool add_operator(int client);
+	bool remove_operator(int client);
+	bool is_banned(const std::string &hostmask);
+	MaskList *masks(char mode);
+};
+
+// Every channel in name order, for listings and for walking them all.
+// Keys view the channel's own name, see ServerState::create_channel.
+typedef std::map<StringView, Channel *, std::less<StringView>,
+	PoolAllocator<std::pair<const StringView, Channel *> > > ChannelDirectory;
+typedef HashTable<Channel *, StringView> ChannelTable;
+
+#endif // CHANNEL_HPP
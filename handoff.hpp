@@ -0,0 +1,20 @@
+#ifndef HANDOFF_HPP
+# define HANDOFF_HPP
+
+# include <string>
+# include <vector>
+
+# define HANDOFF_FDS_PER_MESSAGE 250 // SCM_MAX_FD is 253 on Linux
+# define HANDOFF_ACK_TIMEOUT 10000   // Milliseconds the old process waits for the new one
+
+struct ServerState;
+
+// Hot restart. The running server listens on a Unix socket; a new process
+// started with --takeover connects to it, the old one stops its workers
+// and sends a snapshot of the shared state followed by the listening and
+// client sockets (SCM_RIGHTS). Clients keep their connections throughout.
+int open_handoff_socket(const std::string &path);
+bool send_handoff(ServerState &state, int connection);
+int receive_handoff(ServerState &state, const std::string &path, std::vector<int> &listeners);
+
+#endif // HANDOFF_HPP
@@ -0,0 +1,136 @@
+#ifndef HASH_TABLE_HPP
+# define HASH_TABLE_HPP
+
+# include <string>
+# include <vector>
+# include <cstring>
+# include <cstddef>
+# include "pool.hpp"
+# include "string_view.hpp"
+
+// FNV-1a, keys are short (nicknames, channel names)
+inline size_t hash_bytes(const char *data, size_t length) {
+	size_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+inline const char *key_data(const std::string &key) { return key.data(); }
+inline size_t key_size(const std::string &key) { return key.size(); }
+inline const char *key_data(const StringView &key) { return key.data; }
+inline size_t key_size(const StringView &key) { return key.size; }
+
+// Separate-chaining hash table keyed by std::string, O(1) average
+// lookup. Lookups also take raw bytes so callers holding a view into an
+// input buffer don't have to build a temporary string. With StringView
+// keys the table stores no copy of its own, the bytes must live as
+// long as the entry (a name inside the value, say).
+template <typename V, typename K = std::string>
+class HashTable {
+	private:
+		struct Node {
+			K key;
+			size_t hash;
+			V value;
+			Node *next;
+
+			Node(const K &key, size_t hash, const V &value)
+				: key(key), hash(hash), value(value), next(NULL) {}
+
+			static void *operator new(size_t size) { return pool_allocate(size); }
+			static void operator delete(void *node, size_t size) { pool_release(node, size); }
+		};
+
+		std::vector<Node *> buckets;
+		size_t count;
+
+		HashTable(const HashTable &);
+		HashTable &operator=(const HashTable &);
+
+		Node **slot(const char *key, size_t length, size_t hash) {
+			Node **link = &buckets[hash & (buckets.size() - 1)];
+			while (*link && !((*link)->hash == hash && key_size((*link)->key) == length
+					&& std::memcmp(key_data((*link)->key), key, length) == 0))
+				link = &(*link)->next;
+			return link;
+		}
+
+		void grow() {
+			std::vector<Node *> old;
+			old.swap(buckets);
+			buckets.assign(old.size() * 2, NULL);
+			for (size_t i = 0; i < old.size(); i++) {
+				Node *node = old[i];
+				while (node) {
+					Node *next = node->next;
+					Node **head = &buckets[node->hash & (buckets.size() - 1)];
+					node->next = *head;
+					*head = node;
+					node = next;
+				}
+			}
+		}
+
+	public:
+		HashTable() : buckets(16, (Node *)NULL), count(0) {}
+
+		~HashTable() {
+			clear();
+		}
+
+		V *find(const char *key, size_t length) {
+			Node *node = *slot(key, length, hash_bytes(key, length));
+			return node ? &node->value : NULL;
+		}
+
+		V *find(const std::string &key) {
+			return find(key.data(), key.size());
+		}
+
+		// Returns false and leaves the table untouched if the key exists
+		bool insert(const K &key, const V &value) {
+			size_t hash = hash_bytes(key_data(key), key_size(key));
+			Node **link = slot(key_data(key), key_size(key), hash);
+			if (*link)
+				return false;
+			*link = new Node(key, hash, value);
+			if (++count > buckets.size())
+				grow();
+			return true;
+		}
+
+		bool erase(const std::string &key) {
+			return erase(key.data(), key.size());
+		}
+
+		bool erase(const char *key, size_t length) {
+			Node **link = slot(key, length, hash_bytes(key, length));
+			if (!*link)
+				return false;
+			Node *node = *link;
+			*link = node->next;
+			delete node;
+			count--;
+			return true;
+		}
+
+		void clear() {
+			for (size_t i = 0; i < buckets.size(); i++) {
+				while (buckets[i]) {
+					Node *next = buckets[i]->next;
+					delete buckets[i];
+					buckets[i] = next;
+				}
+			}
+			count = 0;
+		}
+
+		size_t size() const {
+			return count;
+		}
+};
+
+#endif // HASH_TABLE_HPP
@@ -0,0 +1,73 @@
+#ifndef HISTORY_HPP
+# define HISTORY_HPP
+
+# include <string>
+# include <list>
+# include <cstddef>
+# include <pthread.h>
+# include "hash_table.hpp"
+
+# define HISTORY_ARENA_SIZE 16384 // Bytes of history per channel
+
+// Recent messages of one channel, kept in a single fixed arena used as a
+// byte ring of [2-byte length][bytes] records. Appending overwrites the
+// oldest records, nothing is allocated per message.
+class ChannelHistory {
+	private:
+		char *arena;
+		size_t head;  // Offset of the oldest record
+		size_t used;  // Bytes held, headers included
+		size_t count; // Records held
+		size_t limit; // Most records kept
+
+		ChannelHistory(const ChannelHistory &);
+		ChannelHistory &operator=(const ChannelHistory &);
+
+		void put(size_t offset, const char *data, size_t length);
+		void get(size_t offset, char *data, size_t length) const;
+		size_t record_length(size_t offset) const;
+		void drop_oldest();
+
+	public:
+		explicit ChannelHistory(size_t limit);
+		~ChannelHistory();
+
+		void append(const char *data, size_t length);
+		size_t latest(size_t wanted, std::string &out) const;
+		size_t size() const;
+};
+
+// Every channel's history under one memory cap. Arenas are handed out on
+// a channel's first message; when the cap is reached the least recently
+// used channel loses its history. Workers append concurrently under the
+// shared read lock, so the store has its own mutex.
+class HistoryStore {
+	private:
+		struct Entry {
+			ChannelHistory *history;
+			std::list<std::string>::iterator recent; // Position in lru
+		};
+
+		HashTable<Entry> entries;
+		std::list<std::string> lru; // Most recently used first
+		size_t lines;               // Records kept per channel, 0 turns history off
+		size_t memory;              // Cap on the arenas' total size
+		size_t allocated;
+		pthread_mutex_t mutex;
+
+		HistoryStore(const HistoryStore &);
+		HistoryStore &operator=(const HistoryStore &);
+
+		void touch(Entry &entry);
+		void evict_oldest();
+
+	public:
+		HistoryStore(size_t lines, size_t memory);
+		~HistoryStore();
+
+		void record(const std::string &channel, const char *line, size_t length);
+		size_t replay(const std::string &channel, size_t wanted, std::string &out);
+		void forget(const std::string &channel);
+};
+
+#endif // HISTORY_HPP
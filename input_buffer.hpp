@@ -0,0 +1,33 @@
+#ifndef INPUT_BUFFER_HPP
+# define INPUT_BUFFER_HPP
+
+# include <cstddef>
+# include "string_view.hpp"
+
+# define IRC_LINE_MAX 512 // Including the trailing CRLF
+# define INPUT_BUFFER_SIZE (2 * IRC_LINE_MAX)
+
+// Fixed-size per-client receive buffer. Lines are framed in place and
+// handed out as views, the unconsumed tail is moved to the front before
+// the next read (it is always shorter than one line).
+class InputBuffer {
+	private:
+		char bytes[INPUT_BUFFER_SIZE];
+		size_t start;    // First unconsumed byte
+		size_t end;      // One past the last received byte
+		size_t scanned;  // Bytes from start already searched for '\n'
+		bool discarding; // Dropping the rest of an overlong line
+
+	public:
+		InputBuffer();
+
+		char *write_ptr();
+		size_t write_space();
+		void commit(size_t length);
+
+		enum Frame { NONE, LINE, TOO_LONG };
+		Frame next_line(StringView &line);
+		StringView pending() const;
+};
+
+#endif // INPUT_BUFFER_HPP
@@ -12,40 +12,234 @@
 
 #include "ircserv.hpp"
 
-IRCServer::IRCServer(int port, const std::string &password)
-	: password(password) {
-	server_socket = socket(AF_INET, SOCK_STREAM, 0);
-	if (server_socket < 0) {
+ServerConfig::ServerConfig()
+#ifdef __linux__
+	: backend("epoll"),
+#else
+	: backend("poll"),
+#endif
+	  sendq(DEFAULT_SENDQ), sendq_throttle(false), workers(1), stats_interval(60),
+	  flood_rate(DEFAULT_FLOOD_RATE), flood_burst(DEFAULT_FLOOD_BURST), cork_bytes(DEFAULT_CORK_BYTES),
+	  backlog(DEFAULT_BACKLOG), max_clients(0), history_lines(DEFAULT_HISTORY_LINES),
+	  history_memory(DEFAULT_HISTORY_MEMORY), ping_interval(DEFAULT_PING_INTERVAL),
+	  ping_timeout(DEFAULT_PING_TIMEOUT), registration_timeout(DEFAULT_REGISTRATION_TIMEOUT),
+	  idle_timeout(0), log_level(LOG_INFO) {}
+
+bool ServerConfig::parse(const std::string &option) {
+	size_t eq = option.find('=');
+	if (option.compare(0, 2, "--") != 0 || eq == std::string::npos)
+		return false;
+	std::string key = option.substr(2, eq - 2);
+	std::string value = option.substr(eq + 1);
+
+	if (key == "backend" && (value == "uring" || value == "epoll" || value == "poll")) {
+		backend = value;
+		return true;
+	}
+	// Smaller than one line, a client could never be sent anything
+	if (key == "sendq" && atol(value.c_str()) >= IRC_LINE_MAX) {
+		sendq = atol(value.c_str());
+		return true;
+	}
+	if (key == "sendq-policy" && (value == "disconnect" || value == "throttle")) {
+		sendq_throttle = (value == "throttle");
+		return true;
+	}
+	if (key == "workers" && atoi(value.c_str()) >= 1 && atoi(value.c_str()) <= MAX_WORKERS) {
+		workers = atoi(value.c_str());
+		return true;
+	}
+	if (key == "oper-password" && !value.empty()) {
+		oper_password = value;
+		return true;
+	}
+	if (key == "stats-file" && !value.empty()) {
+		stats_file = value;
+		return true;
+	}
+	if (key == "stats-interval" && atoi(value.c_str()) > 0) {
+		stats_interval = atoi(value.c_str());
+		return true;
+	}
+	if (key == "flood-rate" && atol(value.c_str()) >= 0 && value.find_first_not_of("0123456789") == std::string::npos) {
+		flood_rate = atol(value.c_str());
+		return true;
+	}
+	if (key == "flood-burst" && atol(value.c_str()) > 0) {
+		flood_burst = atol(value.c_str());
+		return true;
+	}
+	if (key == "cork-bytes" && !value.empty() && value.find_first_not_of("0123456789") == std::string::npos) {
+		cork_bytes = atol(value.c_str());
+		return true;
+	}
+	if (key == "backlog" && atoi(value.c_str()) > 0) {
+		backlog = atoi(value.c_str());
+		return true;
+	}
+	if (key == "max-clients" && atol(value.c_str()) > 0) {
+		max_clients = atol(value.c_str());
+		return true;
+	}
+	if (key == "history-lines" && !value.empty() && value.find_first_not_of("0123456789") == std::string::npos) {
+		history_lines = atol(value.c_str());
+		return true;
+	}
+	if (key == "history-memory" && atol(value.c_str()) > 0) {
+		history_memory = atol(value.c_str());
+		return true;
+	}
+	if (key == "handoff-socket" && !value.empty()) {
+		handoff_socket = value;
+		return true;
+	}
+	if (key == "takeover" && !value.empty()) {
+		takeover = value;
+		return true;
+	}
+	bool seconds = !value.empty() && value.size() < 10 && value.find_first_not_of("0123456789") == std::string::npos;
+	if (key == "ping-interval" && seconds) {
+		ping_interval = atoi(value.c_str());
+		return true;
+	}
+	if (key == "ping-timeout" && seconds && atoi(value.c_str()) > 0) {
+		ping_timeout = atoi(value.c_str());
+		return true;
+	}
+	if (key == "registration-timeout" && seconds) {
+		registration_timeout = atoi(value.c_str());
+		return true;
+	}
+	if (key == "idle-timeout" && seconds) {
+		idle_timeout = atoi(value.c_str());
+		return true;
+	}
+	if (key == "server-name" && !value.empty() && value.find_first_of(" :,") == std::string::npos) {
+		server_name = value;
+		return true;
+	}
+	if (key == "link-password" && !value.empty() && value.find(' ') == std::string::npos) {
+		link_password = value;
+		return true;
+	}
+	if (key == "log-file" && !value.empty()) {
+		log_file = value;
+		return true;
+	}
+	if (key == "log-level" && log_parse_level(value, log_level))
+		return true;
+	if (key == "capture" && !value.empty()) {
+		capture_file = value;
+		return true;
+	}
+	size_t colon = value.rfind(':');
+	if (key == "link" && colon != std::string::npos && colon > 0
+		&& atoi(value.c_str() + colon + 1) > 0 && atoi(value.c_str() + colon + 1) <= 65535) {
+		links.push_back(value);
+		return true;
+	}
+	return false;
+}
+
+IRCServer::IRCServer(ServerState &state, int worker_id, int port, int listener)
+	: state(state), worker_id(worker_id), poller(Poller::create(state.config.backend)),
+	  draining(false), turn(0),
+	  inbox(state.config.workers, (Mailbox *)NULL), overflow(state.config.workers),
+	  posted(state.config.workers, false), timers(monotonic_ns() / (TIMER_TICK_MS * 1000000ULL)),
+	  next_link_attempt(0), command_fanout(0), next_stats_dump(0), capture_since(0),
+	  password(state.password), config(state.config),
+	  clients(state.clients), nicknames(state.nicknames), channels(state.channels) {
+	// A hot restart hands over the predecessor's already listening socket
+	server_socket = listener >= 0 ? listener : bind_listener(port);
+	set_non_blocking(server_socket);
+
+	if (pipe(wakeup_pipe) < 0) {
+		std::cerr << "Error: Cannot create wakeup pipe" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	set_non_blocking(wakeup_pipe[0]);
+	set_non_blocking(wakeup_pipe[1]);
+	reserve_fd = open("/dev/null", O_RDONLY);
+	handoff_socket = -1;
+	if (worker_id == 0 && !config.handoff_socket.empty()) {
+		handoff_socket = open_handoff_socket(config.handoff_socket);
+		if (handoff_socket < 0) {
+			std::cerr << "Error: Cannot listen on handoff socket " << config.handoff_socket << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!poller->add(server_socket, POLLIN) || !poller->add(wakeup_pipe[0], POLLIN)
+		|| (handoff_socket >= 0 && !poller->add(handoff_socket, POLLIN))) {
+		std::cerr << "Error: Cannot watch listening socket" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	poller->serve_accepts(server_socket);
+	for (int i = 0; i < config.workers; i++) {
+		if (i != worker_id)
+			inbox[i] = new Mailbox();
+	}
+	if (worker_id == 0)
+		outbound.assign(config.links.size(), std::make_pair(-1, 0u));
+	if (worker_id == 0)
+		log_write(LOG_INFO, "started backend=%s workers=%d server=%s", poller->name(), config.workers,
+			config.server_name.c_str());
+}
+
+IRCServer::~IRCServer() {
+	Delivery delivery;
+	for (size_t i = 0; i < inbox.size(); i++) {
+		while (inbox[i] && inbox[i]->pop(delivery))
+			BufferRef release(delivery.buffer);
+		delete inbox[i];
+	}
+	for (size_t i = 0; i < overflow.size(); i++) {
+		for (size_t j = 0; j < overflow[i].size(); j++)
+			BufferRef release(overflow[i][j].buffer);
+	}
+	delete poller;
+	close(wakeup_pipe[0]);
+	close(wakeup_pipe[1]);
+	if (reserve_fd >= 0)
+		close(reserve_fd);
+	if (handoff_socket >= 0)
+		close(handoff_socket);
+	close(server_socket);
+}
+
+int IRCServer::bind_listener(int port) {
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener < 0) {
 		std::cerr << "Error: Cannot create socket" << std::endl;
 		exit(EXIT_FAILURE);
 	}
 
+#ifdef SO_REUSEPORT
+	// Every worker binds its own listening socket, the kernel spreads
+	// connections. A successor after a handoff may run more workers.
+	int reuse = 1;
+	if ((config.workers > 1 || !config.handoff_socket.empty()) && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+		std::cerr << "Error: Cannot share the port between workers" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+#endif
+
 	struct sockaddr_in server_addr;
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_addr.s_addr = INADDR_ANY;
 	server_addr.sin_port = htons(port);
 
-	if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+	if (bind(listener, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
 		std::cerr << "Error: Cannot bind socket" << std::endl;
 		exit(EXIT_FAILURE);
 	}
 
-	if (listen(server_socket, MAX_CLIENTS) < 0) {
+	if (listen(listener, config.backlog) < 0) {
 		std::cerr << "Error: Cannot listen on socket" << std::endl;
 		exit(EXIT_FAILURE);
 	}
 
-	set_non_blocking(server_socket);
-
-	struct pollfd server_pollfd;
-	server_pollfd.fd = server_socket;
-	server_pollfd.events = POLLIN;
-	server_pollfd.revents = 0;
-	fds.push_back(server_pollfd);
-}
-
-IRCServer::~IRCServer() {
-	close(server_socket);
+	return listener;
 }
 
 void IRCServer::set_non_blocking(int socket) {
@@ -56,23 +250,79 @@ void IRCServer::set_non_blocking(int socket) {
 }
 
 void IRCServer::start() {
-	
+	log_set_worker(worker_id);
 	while (live) {
-		int poll_count = poll(&fds[0], fds.size(), -1);
+		int poll_count = poller->wait(ready, poll_timeout());
 		if (!live)
 			break ;
 		if (poll_count < 0) {
+			if (errno == EINTR)
+				continue ;
 			std::cerr << "Error: Polling failed" << std::endl;
 			exit(EXIT_FAILURE);
 		}
-		for (size_t i = 0; i < fds.size(); i++) {
-			if (fds[i].revents & POLLIN) {
-				if (fds[i].fd == server_socket) {
-					accept_new_client();
-				} else {
-					handle_client(fds[i].fd);
-				}
+		stat_add(stats.wakeups, 1);
+		turn++;
+		stats.ready_per_wakeup.record(ready.size());
+		advance_timers();
+		for (size_t i = 0; i < ready.size(); i++) {
+			int fd = ready[i].fd;
+			if (ready[i].kind != POLL_READY) {
+				// Skipped if the fd was closed since, even if it is open again
+				if (poller->current(ready[i]))
+					complete_io(ready[i]);
+				continue ;
+			}
+			if (fd == server_socket) {
+				accept_new_clients();
+				continue ;
+			}
+			if (fd == handoff_socket) {
+				begin_handoff();
+				continue ;
+			}
+			if (fd == wakeup_pipe[0]) {
+				char drain[64];
+				while (read(wakeup_pipe[0], drain, sizeof(drain)) > 0)
+					;
+				continue ;
 			}
+			// An earlier event in this batch may already have closed it
+			Client *client = find_client(fd);
+			if (!client || client->state != Client::ACTIVE)
+				continue ;
+			if (ready[i].events & POLLOUT)
+				flush_client(fd);
+			if ((ready[i].events & (POLLIN | POLLERR | POLLHUP)) && client->state == Client::ACTIVE)
+				handle_client(fd);
+		}
+		service_backlog();
+		continue_listings();
+		run_timers();
+		deliver_mail();
+		flush_corked_clients();
+		reap_closed_clients();
+		flush_capture(false);
+		ready.clear(); // Handled, settle_io must not see them again
+	}
+	settle_io();
+	flush_capture(true);
+}
+
+// The loop stopped for a handoff or shutdown. The last wait's
+// completions still count, and a completion poller's reads are stopped
+// so the clients hold everything that was taken off their sockets.
+// What they received is kept unread, a resumed loop runs it.
+void IRCServer::settle_io() {
+	draining = true;
+	for (int pass = 0; pass < 2; pass++) {
+		for (size_t i = 0; i < ready.size(); i++) {
+			if (ready[i].kind != POLL_READY && poller->current(ready[i]))
+				complete_io(ready[i]);
 		}
+		ready.clear();
+		if (pass == 0)
+			poller->drain(ready);
 	}
+	draining = false;
 }
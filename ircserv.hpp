@@ -19,57 +19,429 @@
 # include <map>
 # include <vector>
 # include <set>
+# include <deque>
+# include <algorithm>
 # include <sys/socket.h>
 # include <netinet/in.h>
 # include <arpa/inet.h>
 # include <poll.h>
 # include <unistd.h>
 # include <fcntl.h>
-# include <sstream>
+# include <cctype>
 # include <cstdlib>
+# include <cstring>
 # include <signal.h>
+# include <pthread.h>
+# include <cerrno>
+# include <sys/uio.h>
+# include "poller.hpp"
+# include "buffer.hpp"
+# include "nick_registry.hpp"
+# include "input_buffer.hpp"
+# include "message.hpp"
+# include "mailbox.hpp"
+# include "stats.hpp"
+# include "history.hpp"
+# include "handoff.hpp"
+# include "timer_wheel.hpp"
+# include "pool.hpp"
+# include "hash_table.hpp"
+# include "log.hpp"
+# include "channel.hpp"
+# include "listing.hpp"
+# include "capture.hpp"
 
-extern int live;
+extern volatile sig_atomic_t live;
 
-# define MAX_CLIENTS 100
-# define BUFFER_SIZE 1024
+# define DEFAULT_HISTORY_LINES 50
+# define DEFAULT_HISTORY_MEMORY (4 << 20)
+# define DEFAULT_BACKLOG SOMAXCONN // The kernel caps it at net.core.somaxconn
+# define READS_PER_WAKEUP 16
+# define READ_BYTES_PER_WAKEUP (READS_PER_WAKEUP * INPUT_BUFFER_SIZE) // The same cap when the poller reads
+# define DEFAULT_SENDQ 262144
+# define MAX_IOVECS 1024 // IOV_MAX on Linux, so a turn's output mostly leaves in one send
+# define MAX_WORKERS 64
+# define DEFAULT_FLOOD_RATE 10  // Tokens per second
+# define DEFAULT_FLOOD_BURST 20 // Bucket size, in tokens
+# define FLOOD_FANOUT_STEP 64   // Broadcast recipients charged as one extra token
+# define DEFAULT_CORK_BYTES 16384 // Queued bytes that trigger a flush before the end of the turn
+# define DEFAULT_PING_INTERVAL 120     // Seconds of silence before the server sends a PING
+# define DEFAULT_PING_TIMEOUT 60       // Seconds a PING may go unanswered
+# define DEFAULT_REGISTRATION_TIMEOUT 60 // Seconds to complete NICK, PASS and USER
+# define MAX_REMOTE_USERS 65536 // Slab slots past the fd range, for users on linked servers
+# define LINK_RETRY_INTERVAL 10 // Seconds between attempts to reach a --link peer
+# define LINK_SENDQ_FACTOR 16   // A link's sendq is this many client sendqs
 
-struct ChannelMode {
-	bool invite_only;
-	bool topic_restricted;
-	std::string key;
-	int user_limit;
-	std::set<int> operators; // Set of operator socket file descriptors
+// Runtime options given after <port> <password> on the command line
+struct ServerConfig {
+	std::string backend; // "uring", "epoll" or "poll"
+	size_t sendq;        // Outbound high-water mark per client, in bytes
+	bool sendq_throttle; // Drop and pause a slow client instead of disconnecting it
+	int workers;         // Event loop threads, each with its own listening socket
+	std::string oper_password; // OPER is refused while empty
+	std::string stats_file;    // Periodic metrics dump, off while empty
+	int stats_interval;        // Seconds between dumps
+	long flood_rate;           // Token refill per second, 0 turns flood control off
+	long flood_burst;          // Tokens a client may spend at once
+	size_t cork_bytes;         // Output held until the end of the loop turn, 0 sends at once
+	int backlog;               // listen(2) queue length
+	size_t max_clients;        // Connection cap across workers, 0 = as many as fds allow
+	size_t history_lines;      // Messages kept per channel, 0 turns history off
+	size_t history_memory;     // Cap on all channels' history arenas, in bytes
+	std::string handoff_socket; // Unix socket a successor connects to for a hot restart
+	std::string takeover;       // Predecessor's handoff socket to take state from
+	unsigned ping_interval;        // Seconds, 0 never pings
+	unsigned ping_timeout;         // Seconds
+	unsigned registration_timeout; // Seconds, 0 waits forever
+	unsigned idle_timeout;         // Seconds without a command other than PING/PONG, 0 = off
+	std::string server_name;       // Unique across linked servers, "ircserv.<port>" by default
+	std::string link_password;     // Shared by every linked server, links are refused while empty
+	std::vector<std::string> links; // host:port of servers to connect to, worker 0 keeps them up
+	std::string log_file;          // Standard output while empty
+	LogLevel log_level;
+	std::string capture_file;      // Inbound traffic trace for bench/ircreplay.cpp, off while empty
+
+	ServerConfig();
+	bool parse(const std::string &option);
+};
+
+// Bytes accepted for a client but not yet taken by the kernel
+struct SendQueue {
+	typedef std::deque<BufferRef, PoolAllocator<BufferRef> > Chunks;
+
+	Chunks chunks;
+	size_t offset;  // Bytes of chunks.front() already sent
+	size_t bytes;   // Total bytes still waiting
+	bool throttled; // Over the high-water mark, input is paused
+	bool writing;   // POLLOUT is registered with the poller
+	size_t sending; // Bytes handed to Poller::send, 0 unless its completion is due
+	bool corked;    // Waiting for the end-of-turn flush
+
+	SendQueue();
+};
+
+typedef std::set<Channel *, std::less<Channel *>, PoolAllocator<Channel *> > ChannelIndex;
+
+// Everything the server knows about one connection. Records live in a
+// slab indexed by socket and are recycled when the kernel reuses the fd.
+// Users on linked servers get records too, in the slots past the fd
+// range: they have no socket and everything sent to them is dropped,
+// their own server tells them instead.
+//
+// With several workers, the identity fields (registration, nickname,
+// username, channels) are only changed under the ServerState write lock
+// and may be read by any worker holding the read lock. The rest belongs
+// to the owning worker's thread.
+struct Client {
+	enum State { FREE, ACTIVE, CLOSING };
+	enum Registration { REG_NICK = 1, REG_PASS = 2, REG_USER = 4 };
+	enum Liveness { REGISTERING, ALIVE, PINGED };
+	enum Kind { LOCAL, LINK, REMOTE };
+
+	State state;
+	Kind kind;
+	int socket;
+	struct sockaddr_in address; // Peer address, saved at accept
+	int worker;          // Owning worker, atomic
+	unsigned generation; // Bumped on every open, atomic
+	unsigned registration; // REG_* steps completed so far
+	bool oper;             // Server operator, granted by OPER
+	std::string nickname;
+	std::string username;
+	std::string host;     // Peer address as text
+	std::string hostmask; // nick!user@host folded for ban checks, kept current by update_hostmask
+	InputBuffer input;
+	std::string unread; // Received past what input holds while backlogged, fed to it on resume
+	SendQueue output;
+	ChannelIndex channels;          // Channels where the client is a member or operator
+	long tokens;                  // Flood budget in thousandths of a token, may go negative
+	unsigned long long refilled;  // When tokens were last topped up
+	bool backlogged;              // Out of tokens with lines left, or read its share of the turn: reading is paused
+	unsigned long long read_turn; // Loop turn the poller last read for it
+	size_t read_bytes;            // Bytes the poller read for it that turn
+	const char *close_reason;     // Set by schedule_close for the disconnect log line
+	Timer timer;                     // Next liveness check, on the owning worker's wheel
+	Liveness liveness;
+	unsigned long long last_input;   // Tick of the last bytes received
+	unsigned long long last_command; // Tick of the last command other than PING/PONG
+	std::string uid;            // Network-wide id, taken with the first nickname
+	std::string server;         // A link's peer, or the server a remote user is on
+	int link;                   // Remote users: the link socket they are reached through
+	unsigned long long nick_ts; // Wall-clock second the nickname was taken, oldest wins a collision
+	Listing *listing;           // A LIST, NAMES or WHO still being sent, NULL if none
+	unsigned capture_id;        // Connection number in the --capture trace, 0 if not captured
+
+	Client();
+	void open(int client_socket, const struct sockaddr_in &peer, int owner);
+	void reset();
+	void update_hostmask();
+	bool authenticated() const;
+	bool registered() const;
+	int owner() const;
+	unsigned current_generation() const;
+};
+
+class IRCServer;
+
+// State every worker shares. `lock` is read-locked for lookups and
+// broadcasts and write-locked for anything that changes it.
+struct ServerState {
+	std::string password;
+	ServerConfig config;
+	pthread_rwlock_t lock;
+	std::vector<Client *> clients; // Indexed by socket, sized once at startup
+	NickRegistry nicknames;
+	ChannelTable channels;                // Name -> channel, every one has members
+	ChannelDirectory directory;           // The same channels, ordered by name
+	HistoryStore history;
+	std::vector<IRCServer *> workers;
+	unsigned long long started; // monotonic_ns() at startup
+	size_t connections;         // Open client sockets across workers, atomic
+	int handoff_connection;     // A successor waiting for the state, -1 if none
+	size_t remote_base;         // First slab slot for remote users, past every fd
+	std::vector<int> remote_free;         // Unused remote user slots
+	HashTable<int> uids;                  // uid -> slot, local and remote users
+	std::map<std::string, int> servers;   // Every server on the network -> link socket towards it
+	std::vector<int> links;               // Established link sockets
+	unsigned long long next_uid;
+
+	ServerState(const std::string &password, const ServerConfig &config);
+	~ServerState();
+	Channel *find_channel(const std::string &name);
+	Channel *create_channel(const std::string &name);
+	void destroy_channel(Channel *channel);
 };
 
+// Scoped read or write hold on ServerState::lock
+class StateLock {
+	private:
+		pthread_rwlock_t *lock;
+
+		StateLock(const StateLock &);
+		StateLock &operator=(const StateLock &);
 
+	public:
+		enum Mode { NONE, READ, WRITE };
+
+		StateLock(ServerState &state, Mode mode);
+		~StateLock();
+};
+
+// One event loop. Every worker owns the clients it accepted; messages
+// for another worker's client go through that worker's mailboxes.
 class IRCServer {
 	private:
+		// Who may run a command: anyone, once a nickname is set, or once authenticated
+		enum Access { ACCESS_ANY, ACCESS_NICK, ACCESS_AUTH };
+
+		struct CommandSpec {
+			const char *name;
+			void (IRCServer::*handler)(int client_socket, const IrcMessage &msg);
+			int access;
+			StateLock::Mode lock; // How the handler uses ServerState
+			int cost;             // Flood tokens charged per use
+		};
+		static const CommandSpec command_table[];
+		static const size_t command_count;
+
+		// When a link line is accepted: before SERVER, after it, or both
+		enum LinkPhase { LINK_HANDSHAKE, LINK_ESTABLISHED, LINK_ANY };
+
+		struct LinkCommand {
+			const char *name;
+			void (IRCServer::*handler)(int link_socket, int source, const IrcMessage &msg);
+			int phase;
+			StateLock::Mode lock;
+			bool sourced; // Prefixed with the uid of a user behind the link
+		};
+		static const LinkCommand link_table[];
+		static const size_t link_command_count;
+
+		ServerState &state;
+		int worker_id;
 		int server_socket;
-		std::string password;
-		std::map<int, std::string> clients;
-		std::map<std::string, std::set<int> > channels;
-		std::vector<struct pollfd> fds;
-		std::map<int, std::string> usernames;
-		std::map<int, std::string> nicknames;
-		std::map<std::string, ChannelMode> channel_modes;
-		std::map<int, bool> authenticated_clients;
+		int wakeup_pipe[2]; // Written by other workers after posting mail
+		int reserve_fd;     // Spare descriptor given up to shed connections on EMFILE
+		int handoff_socket; // Worker 0 only, -1 unless --handoff-socket is set
+		Poller *poller;
+		std::vector<PollEvent> ready;
+		bool draining; // The loop stopped, received data is only kept
+		unsigned long long turn; // Loop iterations so far
+		std::vector<int> closing;
+		std::vector<int> corked; // Clients with output held for the end of the turn
+		std::vector<std::pair<int, unsigned> > backlog; // Clients waiting for tokens, with their generation
+		std::vector<std::pair<int, unsigned> > serving; // The backlog being worked through, kept for its capacity
+		std::vector<Mailbox *> inbox;                  // inbox[i] holds mail from worker i
+		std::vector<std::deque<Delivery> > overflow;   // Mail that did not fit, per destination
+		std::vector<bool> posted;                      // Destinations to wake up this iteration
+		TimerWheel timers;                             // Liveness checks of this worker's clients
+		std::vector<int> expired;                      // Timers fired this turn, run after the events
+		std::vector<std::pair<int, unsigned> > outbound; // Worker 0: socket and generation per --link, -1 while down
+		unsigned long long next_link_attempt;          // Worker 0: monotonic_ns() of the next reconnect
+		StringView link_line;                          // The link line being handled, passed on as is
+		std::vector<int> relayed;                      // Links a channel line already went to
+		std::vector<std::pair<int, unsigned> > listings; // Clients with a listing to go on with, with their generation
+		Stats stats;                                   // Written by this worker only
+		unsigned long long command_fanout;             // Recipients reached by the running command
+		unsigned long long next_stats_dump;
+		std::string capture_batch;                     // Trace records not yet written
+		unsigned long long capture_since;              // monotonic_ns() of the oldest record in capture_batch
 
+		// Shared state, the same objects for every worker
+		const std::string &password;
+		const ServerConfig &config;
+		std::vector<Client *> &clients;
+		NickRegistry &nicknames;
+		ChannelTable &channels;
+
+		IRCServer(const IRCServer &);
+		IRCServer &operator=(const IRCServer &);
+
+		int bind_listener(int port);
 		void set_non_blocking(int socket);
-		void accept_new_client();
+		Client *find_client(int client_socket);
+		void post(int worker, const Delivery &delivery);
+		int poll_timeout();
+		void collect_stats(Stats &total);
+		void dump_stats();
+		void accept_new_clients();
+		void admit_client(int client_socket, const struct sockaddr_in &client_addr);
+		void begin_handoff();
+		void shed_connection();
 		void handle_client(int client_socket);
-		void remove_client(int client_socket);
-		void process_command(int client_socket, const std::string &command);
+		void complete_io(const PollEvent &event);
+		void settle_io();
+		void receive(int client_socket, const char *data, size_t size);
+		bool feed_input(int client_socket, const char *data, size_t size);
+		bool feed_unread(int client_socket);
+		void sent(int client_socket, int result);
+		void capture_line(int client_socket, const StringView &line, const IrcMessage &msg, const CommandSpec *command);
+		void capture_event(const Client &client, CaptureEvent event);
+		void flush_capture(bool force);
+		int capture_timeout();
+		bool process_input(int client_socket);
+		void refill_tokens(Client &client);
+		void service_backlog();
+		int backlog_timeout();
+		void advance_timers();
+		void run_timers();
+		void check_liveness(Client &client);
+		void schedule_liveness(Client &client);
+		int timer_timeout();
+		void remove_client(int client_socket, const char *reason);
+		void schedule_close(int client_socket, const char *reason);
+		void reap_closed_clients();
+		void flush_client(int client_socket);
+		size_t gather_output(const SendQueue &queue, struct iovec *iov);
+		bool queue_send(int client_socket);
+		bool consume_output(SendQueue &queue, size_t sent);
+		void settle_output(int client_socket);
+		void flush_corked_clients();
+		void update_interest(int client_socket);
+		void process_command(int client_socket, const StringView &line);
+		void dispatch_command(int client_socket, const CommandSpec *command, const IrcMessage &msg);
 		void send_to_client(int client_socket, const std::string &message);
-		void send_to_channel(const std::string &channel, const std::string &message, int sender_socket);
+		void send_to_client(int client_socket, const BufferRef &message);
+		void send_to_channel(Channel &channel, const std::string &message, int sender_socket);
+		void send_to_channel(Channel &channel, const BufferRef &message, int sender_socket);
 		bool is_nickname_taken(const std::string &nickname);
+		void add_member(Channel &channel, int client_socket);
+		void remove_member(Channel &channel, int client_socket);
+		void set_operator(Channel &channel, int client_socket, bool is_operator);
+		bool reclaim_channel(Channel &channel);
+		void send_mask_list(int client_socket, Channel &channel, char mode);
+		void change_mask(int client_socket, Channel &channel, char mode, bool adding, const std::string &argument);
+		void leave_all_channels(int client_socket);
 		void join_channel(int client_socket, const std::string &channel_name, const std::string &channel_password);
-		void handle_privmsg(int client_socket, const std::string &target, const std::string &message);
+		void handle_privmsg(int client_socket, const std::string &target, const StringView &message);
+		size_t send_history(int client_socket, const std::string &channel, size_t wanted);
+
+		static const CommandSpec *find_command(const StringView &verb);
+		void cmd_quit(int client_socket, const IrcMessage &msg);
+		void cmd_nick(int client_socket, const IrcMessage &msg);
+		void cmd_pass(int client_socket, const IrcMessage &msg);
+		void cmd_user(int client_socket, const IrcMessage &msg);
+		void cmd_mode(int client_socket, const IrcMessage &msg);
+		void cmd_join(int client_socket, const IrcMessage &msg);
+		void cmd_privmsg(int client_socket, const IrcMessage &msg);
+		void cmd_kick(int client_socket, const IrcMessage &msg);
+		void cmd_invite(int client_socket, const IrcMessage &msg);
+		void cmd_topic(int client_socket, const IrcMessage &msg);
+		void cmd_oper(int client_socket, const IrcMessage &msg);
+		void cmd_stats(int client_socket, const IrcMessage &msg);
+		void cmd_chathistory(int client_socket, const IrcMessage &msg);
+		void cmd_ping(int client_socket, const IrcMessage &msg);
+		void cmd_pong(int client_socket, const IrcMessage &msg);
+		void cmd_server(int client_socket, const IrcMessage &msg);
+		void change_modes(int client_socket, Channel &channel, const IrcMessage &msg);
+
+		// Directory listings, srcs/listing.cpp
+		void cmd_list(int client_socket, const IrcMessage &msg);
+		void cmd_names(int client_socket, const IrcMessage &msg);
+		void cmd_who(int client_socket, const IrcMessage &msg);
+		void start_listing(int client_socket, Listing *listing);
+		size_t listing_room(const Client &client) const;
+		void continue_listings();
+		int listing_timeout();
+		bool run_listing(int client_socket, size_t room);
+		void who_line(std::string &out, const std::string &channel, int user, bool op);
+		bool list_channels(Listing &listing, std::string &out, size_t &budget, size_t room);
+		bool list_users(Listing &listing, std::string &out, size_t &budget, size_t room);
+
+		// Server links, srcs/links.cpp
+		void connect_links();
+		int link_timeout();
+		void establish_link(int link_socket, const std::string &name);
+		bool valid_peer(int link_socket, const std::string &name, const std::string &link_password);
+		void send_burst(int link_socket);
+		void process_link_line(int link_socket, const StringView &line);
+		void send_to_links(const BufferRef &line, int except_link);
+		void send_to_links(const std::string &line, int except_link);
+		void relay_to_channel(Channel &channel, const BufferRef &line, int except_link);
+		void forward_line(int except_link);
+		void unlink_servers(int link_socket);
+		void drop_server(const std::string &name);
+		void assign_uid(Client &client);
+		void introduce_user(int client_socket);
+		int find_user(const StringView &uid);
+		int add_remote_user(int link_socket, const IrcMessage &msg);
+		void remove_remote_user(int user);
+		void claim_nickname(int user, const std::string &nickname, unsigned long long nick_ts);
+		void rename_to_uid(int user);
+		std::string mode_line(const Channel &channel, int source);
+		void link_server(int link_socket, int source, const IrcMessage &msg);
+		void link_error(int link_socket, int source, const IrcMessage &msg);
+		void link_ping(int link_socket, int source, const IrcMessage &msg);
+		void link_pong(int link_socket, int source, const IrcMessage &msg);
+		void link_linked(int link_socket, int source, const IrcMessage &msg);
+		void link_squit(int link_socket, int source, const IrcMessage &msg);
+		void link_uid(int link_socket, int source, const IrcMessage &msg);
+		void link_nick(int link_socket, int source, const IrcMessage &msg);
+		void link_quit(int link_socket, int source, const IrcMessage &msg);
+		void link_join(int link_socket, int source, const IrcMessage &msg);
+		void link_kick(int link_socket, int source, const IrcMessage &msg);
+		void link_invite(int link_socket, int source, const IrcMessage &msg);
+		void link_chanop(int link_socket, int source, const IrcMessage &msg);
+		void link_cmode(int link_socket, int source, const IrcMessage &msg);
+		void link_mask(int link_socket, int source, const IrcMessage &msg);
+		void link_sjoin(int link_socket, int source, const IrcMessage &msg);
+		void link_topic(int link_socket, int source, const IrcMessage &msg);
+		void link_privmsg(int link_socket, int source, const IrcMessage &msg);
 
 	public:
-		IRCServer(int port, const std::string &password);
+		IRCServer(ServerState &state, int worker_id, int port, int listener);
 		~IRCServer();
 		void start();
+		void wake();
+		const Stats &statistics() const;
+
+		// Hot restart, only called while no worker thread runs
+		bool wake_workers();
+		void deliver_mail();
+		int listener() const;
+		void adopt_clients();
 };
 
+int run_server(int port, const std::string &password, const ServerConfig &config);
+
 #endif // IRCSERV_HPP
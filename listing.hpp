@@ -0,0 +1,33 @@
+#ifndef LISTING_HPP
+# define LISTING_HPP
+
+# include <string>
+# include <cstddef>
+
+# define LISTING_BATCH 100  // Entries sent per loop turn
+# define LISTING_SCAN 4096  // Names looked at per loop turn, matching or not
+
+// A LIST, NAMES or WHO still being answered. The answer goes out one
+// batch per loop turn while the client's send queue has room, each batch
+// picking up past the last name reached, so channels and users coming
+// and going in between are simply seen or not.
+struct Listing {
+	enum Kind { LIST, NAMES, WHO, WHO_USERS };
+
+	Kind kind;
+	std::string mask;       // Glob over channel names, or folded nicknames for WHO_USERS
+	std::string prefix;     // The mask up to its first wildcard, bounds the scan
+	std::string topic_mask; // LIST: glob the topic has to match, empty for any
+	size_t min_members;     // LIST: more members than this
+	size_t max_members;     // LIST: fewer members than this, 0 for no bound
+	std::string resume;     // Last name reached, empty before the first batch
+	int resume_member;      // NAMES and WHO: last member sent of `resume`, -1 once it is done
+
+	Listing(Kind kind, const std::string &mask);
+};
+
+// '*' matches any run of characters, '?' any one character
+bool glob_match(const char *pattern, size_t pattern_size, const char *text, size_t text_size);
+bool glob_match(const std::string &pattern, const std::string &text);
+
+#endif // LISTING_HPP
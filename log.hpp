@@ -0,0 +1,33 @@
+#ifndef LOG_HPP
+# define LOG_HPP
+
+# include <string>
+
+# define LOG_RING_SLOTS 4096 // Power of two, lines past it are dropped
+# define LOG_LINE_MAX 240    // Longer lines are cut
+# define LOG_IDLE_MS 10      // How long the writer sleeps on an empty ring
+
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+// Leveled logging that never blocks the event loop. Each line is
+// formatted straight into a slot of a preallocated lock-free ring, with
+// a coarse wall-clock stamp; a background thread drains the ring to the
+// log file. When the ring is full the line is dropped and counted, a
+// stalled log reader costs lines, not latency.
+//
+// Lines are "<time> <LEVEL> [worker=<n>] <event> key=value...".
+bool log_open(const std::string &path, LogLevel level);
+void log_close();
+void log_write(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_set_worker(int worker);
+bool log_parse_level(const std::string &name, LogLevel &level);
+unsigned long long log_dropped();
+
+extern LogLevel log_threshold;
+
+// Lets a caller skip building the arguments of a line nobody wants
+inline bool log_enabled(LogLevel level) {
+	return level >= log_threshold;
+}
+
+#endif // LOG_HPP
@@ -0,0 +1,51 @@
+#ifndef MAILBOX_HPP
+# define MAILBOX_HPP
+
+# include <vector>
+# include <cstddef>
+# include "buffer.hpp"
+
+# define MAILBOX_CAPACITY 4096 // Power of two, overflow is kept by the producer
+
+// A message for a client owned by another worker. The buffer reference
+// travels with the delivery and is released by the receiving worker.
+struct Delivery {
+	int client_socket;
+	unsigned generation; // Client::generation when posted, stale mail is dropped
+	SharedBuffer *buffer;
+};
+
+// Bounded lock-free single-producer/single-consumer ring. Exactly one
+// worker pushes and exactly one (the owner) pops.
+class Mailbox {
+	private:
+		std::vector<Delivery> ring;
+		size_t head; // Next slot to pop, written by the consumer
+		size_t tail; // Next slot to push, written by the producer
+
+		Mailbox(const Mailbox &);
+		Mailbox &operator=(const Mailbox &);
+
+	public:
+		Mailbox() : ring(MAILBOX_CAPACITY), head(0), tail(0) {}
+
+		bool push(const Delivery &delivery) {
+			size_t t = tail;
+			if (t - __atomic_load_n(&head, __ATOMIC_ACQUIRE) == ring.size())
+				return false;
+			ring[t & (ring.size() - 1)] = delivery;
+			__atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+			return true;
+		}
+
+		bool pop(Delivery &delivery) {
+			size_t h = head;
+			if (h == __atomic_load_n(&tail, __ATOMIC_ACQUIRE))
+				return false;
+			delivery = ring[h & (ring.size() - 1)];
+			__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+			return true;
+		}
+};
+
+#endif // MAILBOX_HPP
@@ -1,6 +1,6 @@
 #include "ircserv.hpp"
 
-int live = true;
+volatile sig_atomic_t live = true;
 
 void	handle_sigint(int signum)
 {
@@ -11,16 +11,30 @@ void	handle_sigint(int signum)
 int main(int argc, char *argv[]) {
 	signal(SIGQUIT, SIG_IGN);
 	signal(SIGINT, &handle_sigint);
-	if (argc != 3 || atoi(argv[1]) < 49152 || atoi(argv[1]) > 65535) {
-		std::cerr << "Usage: ./ircserv <port> (49152-65535) <password>" << std::endl;
+	ServerConfig config;
+	bool valid_options = true;
+	for (int i = 3; i < argc; i++)
+		valid_options = valid_options && config.parse(argv[i]);
+	if (argc < 3 || !valid_options || (!config.links.empty() && config.link_password.empty()) || atoi(argv[1]) < 49152 || atoi(argv[1]) > 65535) {
+		std::cerr << "Usage: ./ircserv <port> (49152-65535) <password>"
+			<< " [--backend=uring|epoll|poll] [--sendq=<bytes>] [--sendq-policy=disconnect|throttle]"
+			<< " [--workers=<1-" << MAX_WORKERS << ">] [--oper-password=<password>]"
+			<< " [--stats-file=<path>] [--stats-interval=<seconds>]"
+			<< " [--flood-rate=<tokens/s, 0 = off>] [--flood-burst=<tokens>] [--cork-bytes=<bytes>]"
+			<< " [--backlog=<connections>] [--max-clients=<connections>]"
+			<< " [--history-lines=<messages>] [--history-memory=<bytes>]"
+			<< " [--handoff-socket=<path>] [--takeover=<path>]"
+			<< " [--ping-interval=<seconds, 0 = off>] [--ping-timeout=<seconds>]"
+			<< " [--registration-timeout=<seconds, 0 = off>] [--idle-timeout=<seconds, 0 = off>]"
+			<< " [--server-name=<name>] [--link-password=<password>] [--link=<host>:<port>]..."
+			<< " [--log-file=<path>] [--log-level=debug|info|warn|error] [--capture=<path>]" << std::endl;
 		return 1;
 	}
 	int port = atoi(argv[1]);
 	std::string password = argv[2];
+	if (config.server_name.empty())
+		config.server_name = std::string("ircserv.") + argv[1];
 
-	IRCServer server(port, password);
-	server.start();
-
-	return 0;
+	return run_server(port, password, config);
 }
 
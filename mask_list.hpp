@@ -0,0 +1,51 @@
+#ifndef MASK_LIST_HPP
+# define MASK_LIST_HPP
+
+# include <string>
+# include <vector>
+# include <cstddef>
+# include "hash_table.hpp"
+
+# define MAX_CHANNEL_MASKS 1000 // Entries per ban, exception or invite list
+
+// A channel's +b, +e or +I list. Masks are nick!user@host globs, folded
+// like nicknames and compiled once when set: checking a client parses
+// nothing. Masks with a literal host (the usual *!*@addr) are filed
+// under that host so only those for the client's own host are tried,
+// the rest are rejected on their literal prefix before any glob work.
+class MaskList {
+	private:
+		struct Mask {
+			std::string text;                  // Normalized, as listed
+			std::string prefix;                // Literal head, up to the first wildcard
+			std::vector<std::string> segments; // The text split at '*', '?' kept in
+			bool anchored_front;               // Doesn't start with '*'
+			bool anchored_back;                // Doesn't end with '*'
+
+			explicit Mask(const std::string &text);
+			bool matches(const std::string &hostmask) const;
+		};
+
+		std::vector<Mask> masks;
+		HashTable<std::vector<size_t> > by_host; // Literal host -> masks
+		std::vector<size_t> wild;                // Masks with a wildcard in the host
+
+		MaskList(const MaskList &);
+		MaskList &operator=(const MaskList &);
+
+		void reindex();
+
+	public:
+		MaskList();
+
+		static std::string normalize(const std::string &mask);
+
+		bool add(const std::string &mask);
+		bool remove(const std::string &mask);
+		bool matches(const std::string &hostmask);
+		bool empty() const;
+		size_t size() const;
+		const std::string &mask(size_t index) const;
+};
+
+#endif // MASK_LIST_HPP
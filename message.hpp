@@ -0,0 +1,24 @@
+#ifndef MESSAGE_HPP
+# define MESSAGE_HPP
+
+# include <cstddef>
+# include "string_view.hpp"
+
+# define IRC_MAX_PARAMS 15
+
+// One RFC 1459/2812 line split into views, nothing is copied:
+//   [':' prefix SPACE] command *(SPACE middle) [SPACE ':' trailing]
+struct IrcMessage {
+	StringView prefix;
+	StringView command;
+	StringView params[IRC_MAX_PARAMS];
+	size_t param_count;
+	const char *end;
+
+	IrcMessage();
+	bool parse(const StringView &line);
+	StringView param(size_t index) const;
+	StringView rest(size_t index) const;
+};
+
+#endif // MESSAGE_HPP
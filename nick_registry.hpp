@@ -0,0 +1,30 @@
+#ifndef NICK_REGISTRY_HPP
+# define NICK_REGISTRY_HPP
+
+# include <string>
+# include <map>
+# include "hash_table.hpp"
+
+// Nickname -> socket index, the reverse direction is Client::nickname.
+// Nicknames compare with the rfc1459 casemapping: A-Z and []\^ fold to
+// a-z and {}|~. The same pairs are also kept in order for WHO scans.
+class NickRegistry {
+	public:
+		typedef std::map<std::string, int, std::less<std::string>,
+			PoolAllocator<std::pair<const std::string, int> > > Directory;
+
+	private:
+		HashTable<int> sockets; // Folded nickname -> socket
+		Directory ordered;      // The same, sorted by folded nickname
+
+	public:
+		static std::string fold(const char *nickname, size_t length);
+		static std::string fold(const std::string &nickname);
+
+		int find(const std::string &nickname);
+		bool claim(int client_socket, const std::string &old_nickname, const std::string &nickname);
+		void release(const std::string &nickname);
+		const Directory &directory() const;
+};
+
+#endif // NICK_REGISTRY_HPP
@@ -0,0 +1,190 @@
+#ifndef POLLER_HPP
+# define POLLER_HPP
+
+# include <string>
+# include <vector>
+# include <poll.h>
+# include <sys/uio.h>
+# include <sys/socket.h>
+# ifdef __linux__
+#  include <sys/epoll.h>
+#  include <sys/syscall.h>
+#  ifdef __NR_io_uring_setup
+#   include <linux/io_uring.h>
+#   if defined(IORING_FEAT_EXT_ARG) && defined(IORING_RECV_MULTISHOT)
+#    define HAVE_IO_URING
+#   endif
+#  endif
+# endif
+
+enum PollKind { POLL_READY, POLL_ACCEPTED, POLL_RECEIVED, POLL_SENT };
+
+// What Poller::wait hands back. Readiness backends only report
+// POLL_READY; a completion backend that did the I/O itself reports the
+// outcome instead.
+struct PollEvent {
+	int fd;
+	short events;     // POLL_READY: POLL* bits
+	PollKind kind;
+	int result;       // ACCEPTED: the new socket, RECEIVED (0 at EOF) and SENT: bytes, or -errno
+	const char *data; // RECEIVED: the bytes, valid until the next wait
+	unsigned serial;  // Which connection on the fd it belongs to, see Poller::current
+
+	PollEvent() : fd(-1), events(0), kind(POLL_READY), result(0), data(NULL), serial(0) {}
+};
+
+// Event loop backend: registration and removal are O(1), wait() only
+// reports descriptors that are actually ready.
+//
+// A completion backend may also do the I/O: accept on a listener, read
+// a stream fd whenever POLLIN is in its interest, and send. It reports
+// a wait's sends ahead of its other events. The readiness backends
+// decline and the caller keeps doing it on POLL_READY.
+class Poller {
+	public:
+		virtual ~Poller() {}
+		virtual const char *name() const = 0;
+		virtual bool add(int fd, short events) = 0;
+		virtual bool modify(int fd, short events) = 0;
+		virtual void remove(int fd) = 0;
+		virtual int wait(std::vector<PollEvent> &ready, int timeout) = 0;
+
+		virtual bool serve_accepts(int fd) { (void)fd; return false; }
+		virtual bool serve_reads(int fd) { (void)fd; return false; }
+		virtual bool send(int fd, const struct iovec *iov, size_t count) { (void)fd; (void)iov; (void)count; return false; }
+		// False once the fd was removed, even if the number is in use again
+		virtual bool current(const PollEvent &event) const { (void)event; return true; }
+		// Stops the reads and accepts in flight and appends what they
+		// still produced, before the loop's state is copied or freed
+		virtual void drain(std::vector<PollEvent> &done) { (void)done; }
+
+		static Poller *create(const std::string &backend);
+};
+
+// Portable fallback, still pays O(connections) inside poll() itself
+class PollPoller : public Poller {
+	private:
+		std::vector<struct pollfd> fds;
+		std::vector<int> slots; // fd -> index in fds, -1 when absent
+
+	public:
+		const char *name() const;
+		bool add(int fd, short events);
+		bool modify(int fd, short events);
+		void remove(int fd);
+		int wait(std::vector<PollEvent> &ready, int timeout);
+};
+
+# ifdef __linux__
+class EpollPoller : public Poller {
+	private:
+		int epoll_fd;
+		std::vector<struct epoll_event> events;
+
+		EpollPoller(const EpollPoller &);
+		EpollPoller &operator=(const EpollPoller &);
+
+	public:
+		EpollPoller();
+		~EpollPoller();
+		bool valid() const;
+		const char *name() const;
+		bool add(int fd, short events);
+		bool modify(int fd, short events);
+		void remove(int fd);
+		int wait(std::vector<PollEvent> &ready, int timeout);
+};
+# endif
+
+# ifdef HAVE_IO_URING
+// io_uring(7) backend through raw system calls. Everything queued during
+// a loop turn reaches the kernel with the wait itself, so a turn costs
+// one system call however much I/O it started.
+//
+// Where the kernel has them (6.0+), a listener is served by a multishot
+// accept and a client by a multishot recv into a ring of provided
+// buffers, and sends are SENDMSG entries with MSG_DONTWAIT: they run
+// inline when submitted and complete with what the socket took. Readiness
+// is left for what those don't cover: POLLOUT after a short send, and
+// hangups while reading is paused. It comes from one-shot POLL_ADD
+// requests re-armed each turn, which keeps level-triggered semantics
+// (multishot polls only fire on new wakeups).
+class UringPoller : public Poller {
+	private:
+		enum Status { ABSENT, IDLE, ARMED, FIRED };      // The readiness poll
+		enum Reading { OFF, READING, CANCELLING, ENDED }; // The multishot accept or recv, ENDED at EOF
+		enum Mode { READINESS, ACCEPTS, READS };
+
+		// Kept until the entry is submitted, the kernel copies it then
+		struct SendSlot {
+			struct msghdr msg;
+			std::vector<struct iovec> iov;
+		};
+
+		int ring_fd;
+		void *sq_ring;
+		size_t sq_ring_size;
+		void *cq_ring;
+		size_t cq_ring_size;
+		struct io_uring_sqe *sqes;
+		size_t sqes_size;
+		unsigned *sq_head;
+		unsigned *sq_tail;
+		unsigned sq_mask;
+		unsigned sq_entries;
+		unsigned sq_queued; // Our tail, published before every enter
+		unsigned *cq_head;
+		unsigned *cq_tail;
+		unsigned cq_mask;
+		struct io_uring_cqe *cqes;
+		std::vector<short> interest;          // fd -> events
+		std::vector<unsigned char> status;    // fd -> Status
+		std::vector<unsigned char> reading;   // fd -> Reading
+		std::vector<unsigned char> modes;     // fd -> Mode
+		std::vector<unsigned> tags;           // fd -> tag of its live poll, stale completions don't match
+		std::vector<unsigned> serials;        // fd -> bumped on removal, outdates reads and sends too
+		std::vector<int> fired;               // Polls reported last turn, re-armed before the next wait
+		std::vector<int> ended;               // Reads that stopped, restarted before the next wait if wanted
+		bool completions;                     // Provided buffers are registered
+		char *buffers;                        // URING_BUFFERS blocks of URING_BUFFER_SIZE
+		struct io_uring_buf_ring *buffer_ring;
+		unsigned short buffer_tail;
+		std::vector<unsigned short> consumed; // Handed out last turn, given back before the next wait
+		std::vector<SendSlot *> send_slots;
+		size_t sends_queued;                  // Slots in use since the last submission
+
+		UringPoller(const UringPoller &);
+		UringPoller &operator=(const UringPoller &);
+
+		bool map_rings(const struct io_uring_params &params);
+		void setup_buffers();
+		void provide(unsigned short buffer);
+		struct io_uring_sqe *next_sqe();
+		int enter(unsigned to_submit, unsigned min_complete, int timeout);
+		bool serves(int fd) const;
+		bool arm(int fd);
+		void disarm(int fd);
+		bool arm_read(int fd);
+		void cancel_read(int fd);
+		void update(int fd);
+		void read_ended(int fd, int result);
+		void reap(std::vector<PollEvent> &ready);
+
+	public:
+		UringPoller();
+		~UringPoller();
+		bool valid() const;
+		const char *name() const;
+		bool add(int fd, short events);
+		bool modify(int fd, short events);
+		void remove(int fd);
+		int wait(std::vector<PollEvent> &ready, int timeout);
+		bool serve_accepts(int fd);
+		bool serve_reads(int fd);
+		bool send(int fd, const struct iovec *iov, size_t count);
+		bool current(const PollEvent &event) const;
+		void drain(std::vector<PollEvent> &done);
+};
+# endif
+
+#endif // POLLER_HPP
@@ -0,0 +1,70 @@
+#ifndef POOL_HPP
+# define POOL_HPP
+
+# include <new>
+# include <cstddef>
+
+# define POOL_MIN_BLOCK 32
+# define POOL_CLASSES 8       // Power-of-two classes from 32 bytes to 4 KiB
+# define POOL_CACHE_LIMIT 256 // Free blocks a thread keeps per class
+# define POOL_BATCH 64        // Blocks moved between a thread and the depot at once
+
+// Size-class pool for the small blocks every message and connection goes
+// through. Each thread recycles freed blocks from its own free lists;
+// only surplus or shortage moves a batch through the shared depot, so in
+// steady state nothing reaches the global allocator. Larger requests go
+// straight to operator new.
+void *pool_allocate(size_t size);
+void pool_release(void *block, size_t size);
+
+// Calls to the global operator new since startup, -1 unless built with
+// DEBUG=1
+long long allocation_count();
+
+// Standard allocator over the pool, for node-based containers
+template <typename T>
+class PoolAllocator {
+	public:
+		typedef T value_type;
+		typedef T *pointer;
+		typedef const T *const_pointer;
+		typedef T &reference;
+		typedef const T &const_reference;
+		typedef size_t size_type;
+		typedef ptrdiff_t difference_type;
+
+		template <typename U>
+		struct rebind {
+			typedef PoolAllocator<U> other;
+		};
+
+		PoolAllocator() {}
+		template <typename U>
+		PoolAllocator(const PoolAllocator<U> &) {}
+
+		pointer address(reference value) const { return &value; }
+		const_pointer address(const_reference value) const { return &value; }
+
+		pointer allocate(size_type count, const void * = 0) {
+			return static_cast<pointer>(pool_allocate(count * sizeof(T)));
+		}
+		void deallocate(pointer block, size_type count) {
+			pool_release(block, count * sizeof(T));
+		}
+		size_type max_size() const { return (size_t)-1 / sizeof(T); }
+
+		void construct(pointer at, const T &value) { new (at) T(value); }
+		void destroy(pointer at) { at->~T(); }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &) {
+	return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &) {
+	return false;
+}
+
+#endif // POOL_HPP
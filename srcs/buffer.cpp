@@ -0,0 +1,124 @@
+#include "../buffer.hpp"
+#include "../pool.hpp"
+
+#include <cstring>
+#include <new>
+
+SharedBuffer::SharedBuffer(size_t length) : refs(1), length(length) {}
+
+// Header and bytes share one allocation, the bytes follow the object
+SharedBuffer *SharedBuffer::create(const char *data, size_t length) {
+	void *memory = pool_allocate(sizeof(SharedBuffer) + length);
+	SharedBuffer *buffer = new (memory) SharedBuffer(length);
+	std::memcpy(const_cast<char *>(buffer->data()), data, length);
+	return buffer;
+}
+
+void SharedBuffer::retain() {
+	__atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED);
+}
+
+void SharedBuffer::release() {
+	if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		size_t size = sizeof(SharedBuffer) + length;
+		this->~SharedBuffer();
+		pool_release(this, size);
+	}
+}
+
+const char *SharedBuffer::data() const {
+	return reinterpret_cast<const char *>(this + 1);
+}
+
+size_t SharedBuffer::size() const {
+	return length;
+}
+
+BufferRef::BufferRef() : buffer(NULL) {}
+
+BufferRef::BufferRef(const std::string &message)
+	: buffer(SharedBuffer::create(message.data(), message.size())) {}
+
+BufferRef::BufferRef(const char *data, size_t length)
+	: buffer(SharedBuffer::create(data, length)) {}
+
+// Takes over a reference obtained from share()
+BufferRef::BufferRef(SharedBuffer *adopted) : buffer(adopted) {}
+
+BufferRef::BufferRef(const BufferRef &other) : buffer(other.buffer) {
+	if (buffer)
+		buffer->retain();
+}
+
+BufferRef &BufferRef::operator=(const BufferRef &other) {
+	if (other.buffer)
+		other.buffer->retain();
+	if (buffer)
+		buffer->release();
+	buffer = other.buffer;
+	return *this;
+}
+
+BufferRef::~BufferRef() {
+	if (buffer)
+		buffer->release();
+}
+
+const char *BufferRef::data() const {
+	return buffer ? buffer->data() : "";
+}
+
+size_t BufferRef::size() const {
+	return buffer ? buffer->size() : 0;
+}
+
+bool BufferRef::empty() const {
+	return size() == 0;
+}
+
+// A raw reference for a Delivery, the receiver adopts it into a BufferRef
+SharedBuffer *BufferRef::share() const {
+	if (buffer)
+		buffer->retain();
+	return buffer;
+}
+
+MessageBuilder::MessageBuilder() : length(0) {}
+
+void MessageBuilder::append(const char *data, size_t size) {
+	if (spill.empty() && length + size <= MESSAGE_INLINE_SIZE) {
+		std::memcpy(bytes + length, data, size);
+		length += size;
+		return;
+	}
+	if (spill.empty())
+		spill.assign(bytes, length);
+	spill.append(data, size);
+}
+
+MessageBuilder &MessageBuilder::operator<<(const char *text) {
+	append(text, std::strlen(text));
+	return *this;
+}
+
+MessageBuilder &MessageBuilder::operator<<(const std::string &text) {
+	append(text.data(), text.size());
+	return *this;
+}
+
+MessageBuilder &MessageBuilder::operator<<(const StringView &text) {
+	append(text.data, text.size);
+	return *this;
+}
+
+const char *MessageBuilder::data() const {
+	return spill.empty() ? bytes : spill.data();
+}
+
+size_t MessageBuilder::size() const {
+	return spill.empty() ? length : spill.size();
+}
+
+BufferRef MessageBuilder::build() const {
+	return BufferRef(data(), size());
+}
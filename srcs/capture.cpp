@@ -0,0 +1,77 @@
+#include "../capture.hpp"
+#include "../stats.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static int capture_fd = -1;
+static unsigned long long opened; // monotonic_ns() when the capture began
+static unsigned next_connection;
+static pthread_mutex_t writing = PTHREAD_MUTEX_INITIALIZER;
+
+static bool write_all(int fd, const char *data, size_t size) {
+	while (size > 0) {
+		ssize_t written = write(fd, data, size);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0)
+			return false;
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+bool capture_open(const std::string &path) {
+	if (path.empty())
+		return true;
+	capture_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (capture_fd < 0)
+		return false;
+	uint32_t version = CAPTURE_VERSION;
+	std::string header(CAPTURE_MAGIC, 8);
+	header.append(reinterpret_cast<const char *>(&version), sizeof(version));
+	opened = monotonic_ns();
+	return write_all(capture_fd, header.data(), header.size());
+}
+
+void capture_close() {
+	if (capture_fd >= 0)
+		close(capture_fd);
+	capture_fd = -1;
+}
+
+bool capture_enabled() {
+	return capture_fd >= 0;
+}
+
+// Ids for new connections, 0 means not captured
+unsigned capture_connection() {
+	return capture_enabled() ? __atomic_add_fetch(&next_connection, 1, __ATOMIC_RELAXED) : 0;
+}
+
+void capture_append(std::string &batch, unsigned connection, CaptureEvent event, const char *data, size_t length) {
+	uint64_t stamp = monotonic_ns() - opened;
+	uint32_t id = connection;
+	uint8_t kind = event;
+	uint16_t size = length > 0xffff ? 0xffff : length;
+	batch.append(reinterpret_cast<const char *>(&stamp), sizeof(stamp));
+	batch.append(reinterpret_cast<const char *>(&id), sizeof(id));
+	batch.append(reinterpret_cast<const char *>(&kind), sizeof(kind));
+	batch.append(reinterpret_cast<const char *>(&size), sizeof(size));
+	batch.append(data, size);
+}
+
+// A worker's records go in with one write, whole records only
+void capture_write(std::string &batch) {
+	if (capture_fd >= 0 && !batch.empty()) {
+		pthread_mutex_lock(&writing);
+		write_all(capture_fd, batch.data(), batch.size());
+		pthread_mutex_unlock(&writing);
+	}
+	batch.clear();
+}
@@ -1,54 +1,245 @@
 #include "../ircserv.hpp"
 
-void IRCServer::send_to_channel(const std::string &channel, const std::string &message, int sender_socket) {
-	if (channels.find(channel) == channels.end())
+Channel::Channel(const std::string &name)
+	: name(name), invite_only(false), topic_restricted(false), user_limit(0) {}
+
+bool Channel::has_member(int client) const {
+	return std::binary_search(members.begin(), members.end(), client);
+}
+
+bool Channel::is_operator(int client) const {
+	return std::binary_search(operators.begin(), operators.end(), client);
+}
+
+static bool insert_sorted(std::vector<int> &ids, int id) {
+	std::vector<int>::iterator it = std::lower_bound(ids.begin(), ids.end(), id);
+	if (it != ids.end() && *it == id)
+		return false;
+	ids.insert(it, id);
+	return true;
+}
+
+static bool erase_sorted(std::vector<int> &ids, int id) {
+	std::vector<int>::iterator it = std::lower_bound(ids.begin(), ids.end(), id);
+	if (it == ids.end() || *it != id)
+		return false;
+	ids.erase(it);
+	return true;
+}
+
+bool Channel::add_member(int client) {
+	return insert_sorted(members, client);
+}
+
+bool Channel::remove_member(int client) {
+	return erase_sorted(members, client);
+}
+
+bool Channel::add_operator(int client) {
+	return insert_sorted(operators, client);
+}
+
+bool Channel::remove_operator(int client) {
+	return erase_sorted(operators, client);
+}
+
+bool Channel::is_banned(const std::string &hostmask) {
+	return bans.matches(hostmask) && !excepts.matches(hostmask);
+}
+
+// The list behind a b, e or I mode letter
+MaskList *Channel::masks(char mode) {
+	switch (mode) {
+		case 'b': return &bans;
+		case 'e': return &excepts;
+		case 'I': return &invites;
+	}
+	return NULL;
+}
+
+static const char *mask_list_name(char mode) {
+	return mode == 'b' ? "Ban" : mode == 'e' ? "Ban exception" : "Invite exception";
+}
+
+void IRCServer::send_mask_list(int client_socket, Channel &channel, char mode) {
+	const MaskList &list = *channel.masks(mode);
+	std::string out = std::string(mask_list_name(mode)) + " list for channel " + channel.name + ":\n";
+	for (size_t i = 0; i < list.size(); i++)
+		out += list.mask(i) + "\n";
+	send_to_client(client_socket, out + "End of list\n");
+}
+
+void IRCServer::change_mask(int client_socket, Channel &channel, char mode, bool adding, const std::string &argument) {
+	MaskList &list = *channel.masks(mode);
+	std::string mask = MaskList::normalize(argument);
+	if (adding ? !list.add(mask) : !list.remove(mask)) {
+		send_to_client(client_socket, adding ? (list.size() >= MAX_CHANNEL_MASKS ? "Mask list is full\n" : "Mask already listed\n")
+			: "No such mask: " + mask + "\n");
 		return;
+	}
+	send_to_client(client_socket, std::string(mask_list_name(mode)) + (adding ? " added: " : " removed: ") + mask + "\n");
+	send_to_links("MASK " + channel.name + " " + (adding ? "+" : "-") + mode + " " + mask + "\n", -1);
+}
+
+// The table and the directory hold the same objects: the table for
+// lookups by name, the directory for ordered scans. Both key on views
+// of Channel::name, so the name is stored once and never changes while
+// the channel exists.
+
+Channel *ServerState::find_channel(const std::string &name) {
+	Channel **channel = channels.find(name);
+	return channel ? *channel : NULL;
+}
+
+Channel *ServerState::create_channel(const std::string &name) {
+	Channel *channel = new Channel(name);
+	StringView interned(channel->name);
+	directory[interned] = channel;
+	channels.insert(interned, channel);
+	return channel;
+}
 
-	for (std::set<int>::iterator it = channels[channel].begin(); it != channels[channel].end(); ++it) {
+void ServerState::destroy_channel(Channel *channel) {
+	directory.erase(StringView(channel->name));
+	channels.erase(channel->name);
+	history.forget(channel->name);
+	delete channel;
+}
+
+void IRCServer::send_to_channel(Channel &channel, const std::string &message, int sender_socket) {
+	if (!message.empty())
+		send_to_channel(channel, BufferRef(message), sender_socket);
+}
+
+// Rendered once, every member's queue shares the same bytes
+void IRCServer::send_to_channel(Channel &channel, const BufferRef &buffer, int sender_socket) {
+	if (buffer.empty())
+		return;
+
+	unsigned long long recipients = 0;
+	for (std::vector<int>::iterator it = channel.members.begin(); it != channel.members.end(); ++it) {
 		if (*it != sender_socket) {
-			send_to_client(*it, message);
+			send_to_client(*it, buffer);
+			recipients++;
 		}
 	}
+	stats.fanout.record(recipients);
+	command_fanout += recipients;
 }
 
 
+// Membership and operator changes go through these so the per-client
+// index stays in sync with the channel side
 
-void IRCServer::join_channel(int client_socket, const std::string &channel_name, const std::string &channel_password) {
-	// Check if the channel already exists
-	bool is_new_channel = (channels.find(channel_name) == channels.end());
+void IRCServer::add_member(Channel &channel, int client_socket) {
+	channel.add_member(client_socket);
+	clients[client_socket]->channels.insert(&channel);
+}
 
-	// Get or create the channel mode
-	ChannelMode &chan_mode = channel_modes[channel_name];
+void IRCServer::remove_member(Channel &channel, int client_socket) {
+	channel.remove_member(client_socket);
+	if (!channel.is_operator(client_socket))
+		clients[client_socket]->channels.erase(&channel);
+}
 
-	// If the channel is invite-only, check if the client is allowed
-	if (chan_mode.invite_only && !is_new_channel) {
-		send_to_client(client_socket, "Channel is invite-only\n");
-		return;
+void IRCServer::set_operator(Channel &channel, int client_socket, bool is_operator) {
+	if (is_operator) {
+		channel.add_operator(client_socket);
+		clients[client_socket]->channels.insert(&channel);
+	} else {
+		channel.remove_operator(client_socket);
+		if (!channel.has_member(client_socket))
+			clients[client_socket]->channels.erase(&channel);
 	}
+}
 
-	// If the channel has a key (password), prompt the user for it
-	if (!chan_mode.key.empty() && !is_new_channel && chan_mode.key != channel_password) {
-		send_to_client(client_socket, "Incorrect channel key\n");
-		return;
+// Once the last member is gone the channel goes too, along with its
+// modes, topic and history. Operators who had been kicked lose their
+// status. Returns whether it went.
+bool IRCServer::reclaim_channel(Channel &channel) {
+	if (!channel.members.empty())
+		return false;
+	for (std::vector<int>::iterator it = channel.operators.begin(); it != channel.operators.end(); ++it)
+		clients[*it]->channels.erase(&channel);
+	state.destroy_channel(&channel);
+	return true;
+}
+
+// Only visits the channels the client is actually in
+void IRCServer::leave_all_channels(int client_socket) {
+	ChannelIndex &index = clients[client_socket]->channels;
+
+	for (ChannelIndex::iterator it = index.begin(); it != index.end(); ++it) {
+		(*it)->remove_member(client_socket);
+		(*it)->remove_operator(client_socket);
+		reclaim_channel(**it);
 	}
+	index.clear();
+}
 
-	// Check if the user limit has been reached
-	if (chan_mode.user_limit > 0 && channels[channel_name].size() >= (size_t)chan_mode.user_limit) {
-		send_to_client(client_socket, "Channel is full\n");
-		return;
+void IRCServer::join_channel(int client_socket, const std::string &channel_name, const std::string &channel_password) {
+	Channel *existing = state.find_channel(channel_name);
+	bool is_new_channel = (existing == NULL);
+
+	if (existing) {
+		const std::string &hostmask = clients[client_socket]->hostmask;
+		if (existing->is_banned(hostmask)) {
+			send_to_client(client_socket, "You are banned from channel: " + channel_name + "\n");
+			return;
+		}
+
+		// If the channel is invite-only, check if the client is allowed
+		if (existing->invite_only && !existing->invites.matches(hostmask)) {
+			send_to_client(client_socket, "Channel is invite-only\n");
+			return;
+		}
+
+		// If the channel has a key (password), prompt the user for it
+		if (!existing->key.empty() && existing->key != channel_password) {
+			send_to_client(client_socket, "Incorrect channel key\n");
+			return;
+		}
+
+		// Check if the user limit has been reached
+		if (existing->user_limit > 0 && existing->members.size() >= (size_t)existing->user_limit) {
+			send_to_client(client_socket, "Channel is full\n");
+			return;
+		}
 	}
+	Channel &channel = existing ? *existing : *state.create_channel(channel_name);
 
 	// Add the client to the channel
-	channels[channel_name].insert(client_socket);
+	add_member(channel, client_socket);
 
 	// If the channel is new, promote the client to operator
 	if (is_new_channel) {
-		chan_mode.topic_restricted = true;
-		chan_mode.operators.insert(client_socket);
+		channel.topic_restricted = true;
+		set_operator(channel, client_socket, true);
 		send_to_client(client_socket, "You are now an operator of channel: " + channel_name + "\n");
 	}
 
+	if (!state.links.empty()) {
+		const std::string &uid = clients[client_socket]->uid;
+		send_to_links(":" + uid + " JOIN " + channel_name + "\n", -1);
+		if (is_new_channel) {
+			send_to_links(":" + uid + " CHANOP " + channel_name + " " + uid + " +\n", -1);
+			send_to_links(mode_line(channel, client_socket), -1);
+		}
+	}
+
 	// Notify the client and the channel
 	send_to_client(client_socket, "Joined channel: " + channel_name + "\n");
-	send_to_channel(channel_name, nicknames[client_socket] + " has joined the channel\n", client_socket);
-}
\ No newline at end of file
+	if (!channel.topic.empty())
+		send_to_client(client_socket, "Topic for channel " + channel_name + ": " + channel.topic + "\n");
+	send_to_channel(channel, clients[client_socket]->nickname + " has joined the channel\n", client_socket);
+	send_history(client_socket, channel_name, config.history_lines);
+}
+
+// Replays the channel's latest messages as one block, returns how many
+size_t IRCServer::send_history(int client_socket, const std::string &channel, size_t wanted) {
+	std::string replay = "History for channel " + channel + ":\n";
+	size_t replayed = state.history.replay(channel, wanted, replay);
+	if (replayed > 0)
+		send_to_client(client_socket, replay + "End of history\n");
+	return replayed;
+}
@@ -1,77 +1,696 @@
 #include "../ircserv.hpp"
 
+SendQueue::SendQueue() : offset(0), bytes(0), throttled(false), writing(false), sending(0), corked(false) {}
+
+Client::Client() : state(FREE), kind(LOCAL), socket(-1), worker(-1), generation(0), registration(0), oper(false),
+	  tokens(0), refilled(0), backlogged(false), read_turn(0), read_bytes(0), close_reason(NULL), liveness(REGISTERING), last_input(0), last_command(0), link(-1), nick_ts(0), listing(NULL), capture_id(0) {}
+
+void Client::open(int client_socket, const struct sockaddr_in &peer, int owner) {
+	reset();
+	state = ACTIVE;
+	socket = client_socket;
+	address = peer;
+	char text[INET_ADDRSTRLEN];
+	host = inet_ntop(AF_INET, &peer.sin_addr, text, sizeof(text)) ? text : "*";
+	update_hostmask();
+	__atomic_store_n(&worker, owner, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+}
+
+// Back to a free slot, keeps no state from the previous connection
+void Client::reset() {
+	state = FREE;
+	kind = LOCAL;
+	socket = -1;
+	std::memset(&address, 0, sizeof(address));
+	registration = 0;
+	oper = false;
+	nickname.clear();
+	username.clear();
+	host.clear();
+	hostmask.clear();
+	input = InputBuffer();
+	unread.clear();
+	output = SendQueue();
+	channels.clear();
+	tokens = 0;
+	refilled = 0;
+	backlogged = false;
+	read_turn = 0;
+	read_bytes = 0;
+	close_reason = NULL;
+	// A zeroed deadline tells run_timers a recycled slot's timer never fired
+	timer.cancel();
+	timer.expires = 0;
+	liveness = REGISTERING;
+	last_input = 0;
+	last_command = 0;
+	uid.clear();
+	server.clear();
+	link = -1;
+	nick_ts = 0;
+	delete listing;
+	listing = NULL;
+	capture_id = 0;
+}
+
+// After every nickname or username change, so a ban check is one compare
+void Client::update_hostmask() {
+	hostmask = NickRegistry::fold((nickname.empty() ? "*" : nickname) + "!"
+		+ (username.empty() ? "*" : username) + "@" + host);
+}
+
+bool Client::authenticated() const {
+	return registration & REG_PASS;
+}
+
+bool Client::registered() const {
+	return registration == (REG_NICK | REG_PASS | REG_USER);
+}
+
+int Client::owner() const {
+	return __atomic_load_n(&worker, __ATOMIC_ACQUIRE);
+}
+
+unsigned Client::current_generation() const {
+	return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
+// Unlike operator[] on a map this never creates a record. Only meaningful
+// for clients owned by this worker.
+Client *IRCServer::find_client(int client_socket) {
+	if (client_socket < 0 || (size_t)client_socket >= clients.size() || !clients[client_socket]
+		|| clients[client_socket]->owner() != worker_id || clients[client_socket]->state == Client::FREE)
+		return NULL;
+	return clients[client_socket];
+}
+
 bool IRCServer::is_nickname_taken(const std::string &nickname) {
-	for (std::map<int, std::string>::iterator it = nicknames.begin(); it != nicknames.end(); ++it) {
-		if (it->second == nickname) {
-			return true;
+	return nicknames.find(nickname) != -1;
+}
+
+// Best-effort notice, the socket is closed right after
+static void refuse(int client_socket) {
+	const char *full = "Server is full\n";
+	ssize_t ignored = send(client_socket, full, std::strlen(full), MSG_NOSIGNAL | MSG_DONTWAIT);
+	(void)ignored;
+	close(client_socket);
+}
+
+// Takes every pending connection, so a reconnect storm empties the
+// listen queue in one wakeup instead of one connection per poll
+void IRCServer::accept_new_clients() {
+	while (true) {
+		struct sockaddr_in client_addr;
+		socklen_t client_len = sizeof(client_addr);
+#ifdef __linux__
+		int new_client = accept4(server_socket, (struct sockaddr *)&client_addr, &client_len,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		int new_client = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
+		if (new_client >= 0)
+			set_non_blocking(new_client);
+#endif
+		if (new_client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE)
+				shed_connection();
+			else if (errno != EAGAIN && errno != EWOULDBLOCK)
+				log_write(LOG_ERROR, "accept_failed error=\"%s\"", std::strerror(errno));
+			return;
 		}
+
+		admit_client(new_client, client_addr);
 	}
-	return false;
 }
 
-void IRCServer::accept_new_client() {
-	struct sockaddr_in client_addr;
-	socklen_t client_len = sizeof(client_addr);
-	int new_client = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-	if (new_client < 0) {
-		std::cerr << "Error: Cannot accept new client" << std::endl;
+// Sets up the record of an accepted connection and starts reading it
+void IRCServer::admit_client(int new_client, const struct sockaddr_in &client_addr) {
+	size_t open_count = __atomic_add_fetch(&state.connections, 1, __ATOMIC_RELAXED);
+	if ((size_t)new_client >= state.remote_base || (config.max_clients && open_count > config.max_clients)) {
+		log_write(LOG_WARN, "refused fd=%d reason=\"server full\"", new_client);
+		refuse(new_client);
+		__atomic_sub_fetch(&state.connections, 1, __ATOMIC_RELAXED);
 		return;
 	}
+	if (!clients[new_client])
+		clients[new_client] = new Client();
+	Client &client = *clients[new_client];
+	client.open(new_client, client_addr, worker_id);
+	client.tokens = config.flood_burst * 1000;
+	client.refilled = monotonic_ns();
+	client.timer.id = new_client;
+	client.last_input = client.last_command = timers.now();
+	schedule_liveness(client);
+	stat_add(stats.accepted, 1);
 
-	set_non_blocking(new_client);
+	if (!poller->add(new_client, POLLIN)) {
+		log_write(LOG_ERROR, "watch_failed fd=%d", new_client);
+		client.reset();
+		close(new_client);
+		__atomic_sub_fetch(&state.connections, 1, __ATOMIC_RELAXED);
+		stat_add(stats.disconnected, 1);
+		return;
+	}
+	poller->serve_reads(new_client);
+	client.capture_id = capture_connection();
+	if (client.capture_id)
+		capture_event(client, CAPTURE_CONNECT);
+	if (log_enabled(LOG_INFO)) {
+		char address[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &client_addr.sin_addr, address, sizeof(address));
+		log_write(LOG_INFO, "connect fd=%d address=%s:%d", new_client, address, ntohs(client_addr.sin_port));
+	}
+}
+
+// Out of descriptors: the connection would sit in the listen queue and
+// keep the listener readable forever. Give up the spare fd long enough to
+// accept it and hang up, then take the spare back.
+void IRCServer::shed_connection() {
+	if (reserve_fd < 0)
+		return;
+	close(reserve_fd);
+	int rejected = accept(server_socket, NULL, NULL);
+	if (rejected >= 0)
+		refuse(rejected);
+	reserve_fd = open("/dev/null", O_RDONLY);
+	log_write(LOG_WARN, "refused reason=\"out of file descriptors\"");
+}
 
-	struct pollfd client_pollfd;
-	client_pollfd.fd = new_client;
-	client_pollfd.events = POLLIN;
-	client_pollfd.revents = 0;
-	fds.push_back(client_pollfd);
+void IRCServer::handle_client(int client_socket) {
+	Client &client = *clients[client_socket];
+	InputBuffer &input = client.input;
 
-	clients[new_client] = "";
-	usernames[new_client] = "";
-	nicknames[new_client] = "";
+	// Reading is paused while backlogged, so this is a hangup or an error
+	if (client.backlogged) {
+		remove_client(client_socket, "Connection closed");
+		return;
+	}
 
-	std::cout << "New client connected: " << inet_ntoa(client_addr.sin_addr) << ", client_socket: " << new_client << std::endl;
+	// Drain the socket, but cap the reads so one client can't hog the loop
+	for (int reads = 0; reads < READS_PER_WAKEUP && client.state == Client::ACTIVE; reads++) {
+		size_t space = input.write_space();
+		ssize_t bytes_read = recv(client_socket, input.write_ptr(), space, 0);
+		if (bytes_read < 0 && errno == EINTR)
+			continue;
+		if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (bytes_read <= 0) {
+			remove_client(client_socket, bytes_read == 0 ? "Connection closed" : "Read error");
+			return;
+		}
+		input.commit(bytes_read);
+		stat_add(stats.bytes_in, bytes_read);
+		// Any input answers a PING, the wheel looks at it when the deadline fires
+		client.last_input = timers.now();
+		if (client.liveness == Client::PINGED)
+			client.liveness = Client::ALIVE;
+
+		if (!process_input(client_socket))
+			return;
+		if ((size_t)bytes_read < space)
+			return; // Short read, the socket is drained
+	}
 }
 
-void IRCServer::handle_client(int client_socket) {
-	char buffer[BUFFER_SIZE];
-	int bytes_read = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);  // -1 to leave space for null terminator
-	if (bytes_read <= 0) {
-		remove_client(client_socket);
+// What a completion poller did on its own: accepted, read or sent
+void IRCServer::complete_io(const PollEvent &event) {
+	int fd = event.fd;
+	if (event.kind == POLL_ACCEPTED) {
+		if (event.result >= 0) {
+			struct sockaddr_in client_addr;
+			socklen_t client_len = sizeof(client_addr);
+			if (getpeername(event.result, (struct sockaddr *)&client_addr, &client_len) < 0)
+				std::memset(&client_addr, 0, sizeof(client_addr));
+			admit_client(event.result, client_addr);
+		} else if (event.result == -EMFILE || event.result == -ENFILE)
+			shed_connection();
+		else if (event.result != -ECONNABORTED && event.result != -EINTR)
+			log_write(LOG_ERROR, "accept_failed error=\"%s\"", std::strerror(-event.result));
 		return;
 	}
+	Client *client = find_client(fd);
+	if (!client)
+		return;
+	if (event.kind == POLL_SENT) {
+		sent(fd, event.result); // Closing clients too, their queue must stay accurate
+		return;
+	}
+	if (client->state != Client::ACTIVE)
+		return;
+	if (event.result <= 0)
+		remove_client(fd, event.result == 0 ? "Connection closed" : "Read error");
+	else
+		receive(fd, event.data, event.result);
+}
 
-	buffer[bytes_read] = '\0';  // Null-terminate the received data
-	clients[client_socket] += buffer;  // Accumulate data in the client's buffer
+// Bytes the poller read. A backlogged client, or one with older bytes
+// still waiting, keeps them for service_backlog: its read may have been
+// cancelled with some data already on the way. Past its share of the
+// turn, or once the loop stopped, a client is backlogged to pause it.
+void IRCServer::receive(int client_socket, const char *data, size_t size) {
+	Client &client = *clients[client_socket];
+	stat_add(stats.bytes_in, size);
+	client.last_input = timers.now();
+	if (client.liveness == Client::PINGED)
+		client.liveness = Client::ALIVE;
+	if (client.read_turn != turn) {
+		client.read_turn = turn;
+		client.read_bytes = 0;
+	}
+	client.read_bytes += size;
+
+	if (client.backlogged || !client.unread.empty() || draining)
+		client.unread.append(data, size);
+	else if (!feed_input(client_socket, data, size))
+		return;
+	if ((draining || client.read_bytes >= READ_BYTES_PER_WAKEUP) && !client.backlogged) {
+		client.backlogged = true;
+		backlog.push_back(std::make_pair(client_socket, client.current_generation()));
+		update_interest(client_socket);
+	}
+}
 
-	size_t pos;
-	while ((pos = clients[client_socket].find("\n")) != std::string::npos) {
-		std::string command = clients[client_socket].substr(0, pos);
-		clients[client_socket].erase(0, pos + 1);  // Remove the processed command
-		process_command(client_socket, command);  // Process the full command
+// Runs the bytes through input as far as the client can pay for them and
+// keeps the rest in unread. False once the client is backlogged or closing.
+bool IRCServer::feed_input(int client_socket, const char *data, size_t size) {
+	Client &client = *clients[client_socket];
+	while (size > 0) {
+		// After process_input less than a line is left, so there is room
+		size_t length = std::min(size, client.input.write_space());
+		std::memcpy(client.input.write_ptr(), data, length);
+		client.input.commit(length);
+		data += length;
+		size -= length;
+		if (!process_input(client_socket)) {
+			if (client.state == Client::ACTIVE)
+				client.unread.append(data, size);
+			return false;
+		}
 	}
-} 
+	return true;
+}
 
-void IRCServer::remove_client(int client_socket) {
+bool IRCServer::feed_unread(int client_socket) {
+	Client &client = *clients[client_socket];
+	if (client.unread.empty())
+		return true;
+	std::string unread;
+	unread.swap(client.unread);
+	return feed_input(client_socket, unread.data(), unread.size());
+}
+
+// Runs buffered lines while the client can pay for them. A client that
+// runs out keeps its remaining lines buffered, stops being read (so TCP
+// pushes back on it) and is resumed from service_backlog. Returns false
+// once the client is backlogged or closing.
+bool IRCServer::process_input(int client_socket) {
+	Client &client = *clients[client_socket];
+	if (config.flood_rate > 0)
+		refill_tokens(client);
+
+	StringView line;
+	InputBuffer::Frame frame;
+	while (client.state == Client::ACTIVE) {
+		if (config.flood_rate > 0 && client.tokens <= 0 && client.kind != Client::LINK) {
+			if (!client.backlogged) {
+				client.backlogged = true;
+				backlog.push_back(std::make_pair(client_socket, client.current_generation()));
+				update_interest(client_socket);
+			}
+			return false;
+		}
+		if ((frame = client.input.next_line(line)) == InputBuffer::NONE)
+			break;
+		if (frame == InputBuffer::TOO_LONG)
+			send_to_client(client_socket, "Input line too long\n");
+		else if (client.kind == Client::LINK)
+			process_link_line(client_socket, line);
+		else
+			process_command(client_socket, line);
+	}
+	return client.state == Client::ACTIVE;
+}
+
+void IRCServer::refill_tokens(Client &client) {
+	unsigned long long now = monotonic_ns();
+	long limit = config.flood_burst * 1000;
+	unsigned long long earned = (now - client.refilled) * config.flood_rate / 1000000;
+	if (earned == 0)
+		return; // Keep the fraction for the next refill
+	client.refilled = now;
+	client.tokens = (client.tokens + (long long)earned > limit) ? limit : client.tokens + earned;
+}
+
+// Each backlogged client gets at most its budget's worth of lines per
+// turn, in arrival order, so a flooder can't starve anyone else
+void IRCServer::service_backlog() {
+	if (backlog.empty())
+		return;
+	serving.swap(backlog);
+	for (size_t i = 0; i < serving.size(); i++) {
+		int client_socket = serving[i].first;
+		Client *client = find_client(client_socket);
+		// Gone, or the fd was reused by a newer connection
+		if (!client || client->current_generation() != serving[i].second || !client->backlogged)
+			continue;
+		if (client->state != Client::ACTIVE) {
+			client->backlogged = false;
+			continue;
+		}
+		refill_tokens(*client);
+		if (client->tokens <= 0) {
+			backlog.push_back(serving[i]);
+			continue;
+		}
+		client->backlogged = false;
+		if (process_input(client_socket) && feed_unread(client_socket))
+			update_interest(client_socket); // Every buffered line ran, read again
+	}
+	serving.clear();
+}
+
+// Milliseconds until the first backlogged client can afford a line
+int IRCServer::backlog_timeout() {
+	bool waiting = false;
+	long deficit = 0;
+	for (size_t i = 0; i < backlog.size(); i++) {
+		Client *client = find_client(backlog[i].first);
+		if (client && client->backlogged && (!waiting || -client->tokens < deficit)) {
+			deficit = -client->tokens;
+			waiting = true;
+		}
+	}
+	if (!waiting)
+		return -1;
+	if (deficit < 0 || config.flood_rate == 0)
+		return 0; // Already has budget, e.g. an adopted client
+	return (deficit + 1) / config.flood_rate + 1;
+}
+
+void IRCServer::advance_timers() {
+	timers.advance(monotonic_ns() / (TIMER_TICK_MS * 1000000ULL), expired);
+}
+
+// Runs after the turn's events, so input that arrived with the deadline
+// still counts
+void IRCServer::run_timers() {
+	for (size_t i = 0; i < expired.size(); i++) {
+		Client *client = find_client(expired[i]);
+		// Closed meanwhile, or the fd now belongs to a newer connection
+		if (client && client->state == Client::ACTIVE && !client->timer.armed() && client->timer.expires)
+			check_liveness(*client);
+	}
+	expired.clear();
+}
+
+// The client's only timer went off. Activity is not tracked on the wheel,
+// only stamped on the client, so a busy client costs nothing until here.
+void IRCServer::check_liveness(Client &client) {
+	unsigned long long now = timers.now();
+	const char *reason = NULL;
+	if (client.liveness == Client::REGISTERING)
+		reason = "Registration timeout";
+	else if (client.liveness == Client::PINGED)
+		reason = "Ping timeout";
+	else if (config.idle_timeout && now >= client.last_command + config.idle_timeout)
+		reason = "Idle timeout";
+	if (reason) {
+		send_to_client(client.socket, std::string("Closing link: ") + reason + "\n");
+		schedule_close(client.socket, reason);
+		return;
+	}
+
+	if (config.ping_interval && now >= client.last_input + config.ping_interval) {
+		client.liveness = Client::PINGED;
+		send_to_client(client.socket, "PING :ircserv\n");
+		timers.arm(client.timer, now + config.ping_timeout);
+		return;
+	}
+	schedule_liveness(client);
+}
+
+// Arms the registration deadline once, then whichever of the next PING
+// and the idle limit comes first
+void IRCServer::schedule_liveness(Client &client) {
+	if (client.liveness == Client::REGISTERING && client.registered())
+		client.liveness = Client::ALIVE;
+	if (client.liveness == Client::REGISTERING) {
+		if (config.registration_timeout && !client.timer.armed())
+			timers.arm(client.timer, timers.now() + config.registration_timeout);
+		return;
+	}
+
+	unsigned long long due = 0;
+	if (config.ping_interval)
+		due = client.last_input + config.ping_interval;
+	if (config.idle_timeout && (!due || client.last_command + config.idle_timeout < due))
+		due = client.last_command + config.idle_timeout;
+	if (due)
+		timers.arm(client.timer, due);
+	else
+		client.timer.cancel();
+}
+
+// Milliseconds to the wheel's next tick, -1 with nothing armed
+int IRCServer::timer_timeout() {
+	if (timers.size() == 0)
+		return -1;
+	unsigned long long next = (timers.now() + 1) * TIMER_TICK_MS * 1000000ULL;
+	unsigned long long now = monotonic_ns();
+	return next > now ? (next - now) / 1000000 + 1 : 0;
+}
+
+void IRCServer::remove_client(int client_socket, const char *reason) {
+	Client *client = find_client(client_socket);
+	if (!client)
+		return;
+	poller->remove(client_socket);
+	log_write(LOG_INFO, "disconnect fd=%d nick=%s reason=\"%s\"", client_socket,
+		client->nickname.empty() ? "*" : client->nickname.c_str(), reason);
+	{
+		StateLock guard(state, StateLock::WRITE);
+		if (client->kind == Client::LINK)
+			unlink_servers(client_socket);
+		else if (client->authenticated())
+			send_to_links(":" + client->uid + " QUIT\n", -1);
+		if (!client->uid.empty())
+			state.uids.erase(client->uid);
+		nicknames.release(client->nickname);
+		leave_all_channels(client_socket);
+		if (client->capture_id)
+			capture_event(*client, CAPTURE_CLOSE);
+		client->reset();
+	}
+	// Only now may the kernel hand the number to another worker's accept
 	close(client_socket);
-	clients.erase(client_socket);
-	nicknames.erase(client_socket);
-	authenticated_clients[client_socket] = false;
+	__atomic_sub_fetch(&state.connections, 1, __ATOMIC_RELAXED);
+	stat_add(stats.disconnected, 1);
+}
 
-	for (std::map<std::string, std::set<int> >::iterator it = channels.begin(); it != channels.end(); ++it) {
-		it->second.erase(client_socket);
+// Closing is deferred to the end of the loop iteration so that fan-out
+// loops and the command loop never see a client vanish under them
+void IRCServer::schedule_close(int client_socket, const char *reason) {
+	Client *client = find_client(client_socket);
+	if (!client || client->state != Client::ACTIVE)
+		return;
+	client->state = Client::CLOSING;
+	client->close_reason = reason;
+	closing.push_back(client_socket);
+}
+
+void IRCServer::reap_closed_clients() {
+	for (size_t i = 0; i < closing.size(); i++) {
+		flush_client(closing[i]); // Best effort, e.g. a QUIT reply
+		Client *client = find_client(closing[i]);
+		if (client)
+			remove_client(closing[i], client->close_reason);
 	}
+	closing.clear();
+}
+
+void IRCServer::update_interest(int client_socket) {
+	SendQueue &queue = clients[client_socket]->output;
+	short events = 0;
+	queue.writing = queue.bytes > 0 && !queue.sending;
+	if (!queue.throttled && !clients[client_socket]->backlogged)
+		events |= POLLIN;
+	if (queue.writing)
+		events |= POLLOUT;
+	poller->modify(client_socket, events);
+}
+
+void IRCServer::flush_client(int client_socket) {
+	Client *client = find_client(client_socket);
+	if (!client)
+		return;
+	SendQueue &queue = client->output;
+	queue.corked = false;
+	if (queue.sending)
+		return; // Must not overtake it, sent() goes on once it completes
 
-	for (size_t i = 0; i < fds.size(); i++) {
-		if (fds[i].fd == client_socket) {
-			fds.erase(fds.begin() + i);
+	while (!queue.chunks.empty()) {
+		struct iovec iov[MAX_IOVECS];
+		size_t count = gather_output(queue, iov);
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		ssize_t sent = sendmsg(client_socket, &msg, MSG_NOSIGNAL);
+		stat_add(stats.sends, 1);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				schedule_close(client_socket, "Write error");
 			break;
 		}
+
+		if (!consume_output(queue, sent))
+			break; // Short write, the socket buffer is full
 	}
+	settle_output(client_socket);
+}
+
+// As many queued blocks as fit into one send
+size_t IRCServer::gather_output(const SendQueue &queue, struct iovec *iov) {
+	size_t count = 0;
+	for (SendQueue::Chunks::const_iterator chunk = queue.chunks.begin();
+			chunk != queue.chunks.end() && count < MAX_IOVECS; ++chunk, ++count) {
+		size_t skip = (count == 0) ? queue.offset : 0;
+		iov[count].iov_base = const_cast<char *>(chunk->data() + skip);
+		iov[count].iov_len = chunk->size() - skip;
+	}
+	return count;
+}
 
-	std::cout << "Client disconnected: " << client_socket << std::endl;
+// Hands the turn's output to a completion poller, which sends it along
+// with its next wait. False if the poller leaves sending to us.
+bool IRCServer::queue_send(int client_socket) {
+	SendQueue &queue = clients[client_socket]->output;
+	if (queue.writing)
+		return false; // Waiting for POLLOUT after a short write
+	queue.corked = false;
+	if (queue.sending || queue.chunks.empty())
+		return true;
+	struct iovec iov[MAX_IOVECS];
+	size_t count = gather_output(queue, iov);
+	if (!poller->send(client_socket, iov, count))
+		return false;
+	for (size_t i = 0; i < count; i++)
+		queue.sending += iov[i].iov_len;
+	stat_add(stats.sends, 1);
+	return true;
+}
+
+// Drops what went out from the front of the queue, false on a short write
+bool IRCServer::consume_output(SendQueue &queue, size_t sent) {
+	stat_add(stats.bytes_out, sent);
+	queue.bytes -= sent;
+	size_t left = sent;
+	while (left > 0 && left >= queue.chunks.front().size() - queue.offset) {
+		left -= queue.chunks.front().size() - queue.offset;
+		queue.chunks.pop_front();
+		queue.offset = 0;
+	}
+	queue.offset += left;
+	return left == 0;
+}
+
+void IRCServer::settle_output(int client_socket) {
+	SendQueue &queue = clients[client_socket]->output;
+	bool resume = queue.throttled && queue.bytes <= config.sendq / 2;
+	if (resume)
+		queue.throttled = false;
+	if (resume || queue.writing != (queue.bytes > 0 && !queue.sending))
+		update_interest(client_socket);
+}
+
+// The poller's send completed. After a full one the rest of the queue
+// goes out now, as flush_client would have sent it; a short one waits
+// for POLLOUT.
+void IRCServer::sent(int client_socket, int result) {
+	SendQueue &queue = clients[client_socket]->output;
+	size_t wanted = queue.sending;
+	queue.sending = 0;
+	if (result < 0) {
+		if (result != -EAGAIN && result != -EWOULDBLOCK && result != -EINTR)
+			schedule_close(client_socket, "Write error");
+	} else if (consume_output(queue, result) && (size_t)result == wanted
+		&& !queue.chunks.empty() && !draining) {
+		flush_client(client_socket);
+		return;
+	}
+	settle_output(client_socket);
 }
 
 void IRCServer::send_to_client(int client_socket, const std::string &message) {
-	send(client_socket, message.c_str(), message.length(), 0);
-}
\ No newline at end of file
+	if (!message.empty())
+		send_to_client(client_socket, BufferRef(message));
+}
+
+void IRCServer::send_to_client(int client_socket, const BufferRef &message) {
+	// Remote users hear about it from their own server
+	if (client_socket < 0 || (size_t)client_socket >= state.remote_base
+		|| !clients[client_socket] || message.empty())
+		return;
+
+	int owner = clients[client_socket]->owner();
+	if (owner != worker_id) {
+		Delivery delivery;
+		delivery.client_socket = client_socket;
+		delivery.generation = clients[client_socket]->current_generation();
+		delivery.buffer = message.share();
+		post(owner, delivery);
+		return;
+	}
+
+	Client *client = find_client(client_socket);
+	if (!client || client->state != Client::ACTIVE)
+		return;
+	SendQueue &queue = client->output;
+
+	// Dropping a line would leave a linked server out of sync, so a link
+	// gets more room and is always cut off when it runs out
+	bool link = client->kind == Client::LINK;
+	if (queue.bytes + message.size() > (link ? config.sendq * LINK_SENDQ_FACTOR : config.sendq)) {
+		if (!config.sendq_throttle || link) {
+			schedule_close(client_socket, "SendQ exceeded");
+			return;
+		}
+		// Drop whole messages only, so the stream never carries a torn line.
+		// Only a queue with bytes left pauses reading: draining it is what
+		// resumes the client, an empty one would stay paused forever.
+		if (!queue.throttled && queue.bytes > 0) {
+			queue.throttled = true;
+			update_interest(client_socket);
+		}
+		return;
+	}
+
+	queue.chunks.push_back(message);
+	queue.bytes += message.size();
+	stat_add(stats.messages_out, 1);
+	if (queue.writing || queue.sending)
+		return; // POLLOUT or sent() will pick it up
+	// Everything a client gets during one loop turn leaves in one sendmsg,
+	// unless enough piles up to be worth sending right away
+	if (queue.bytes >= config.cork_bytes)
+		flush_client(client_socket);
+	else if (!queue.corked) {
+		queue.corked = true;
+		corked.push_back(client_socket);
+	}
+}
+
+// End of the loop turn, so output waits at most one iteration. A
+// completion poller takes it along with the wait that ends the turn.
+void IRCServer::flush_corked_clients() {
+	for (size_t i = 0; i < corked.size(); i++) {
+		Client *client = find_client(corked[i]);
+		if (client && client->output.corked && !queue_send(corked[i]))
+			flush_client(corked[i]);
+	}
+	corked.clear();
+}
@@ -1,355 +1,616 @@
 #include "../ircserv.hpp"
 
-void IRCServer::handle_privmsg(int client_socket, const std::string &target, const std::string &message) {
-	if (target[0] == '#') {
-		if (channels[target].find(client_socket) == channels[target].end()) {
+#include <sstream>
+#include <ctime>
+
+// The hot path: lines are rendered straight into pooled blocks
+void IRCServer::handle_privmsg(int client_socket, const std::string &target, const StringView &message) {
+	if (!target.empty() && target[0] == '#') {
+		Channel *channel = state.find_channel(target);
+		if (!channel || !channel->has_member(client_socket)) {
 			send_to_client(client_socket, "You are not in the channel: " + target + "\n");
 			return;
 		}
-		send_to_channel(target, nicknames[client_socket] + ": " + message + "\n", client_socket);
-		send_to_client(client_socket, "You: " + message + "\n");
+		// Operators may speak through a ban
+		if (!channel->bans.empty() && channel->is_banned(clients[client_socket]->hostmask)
+			&& !channel->is_operator(client_socket)) {
+			send_to_client(client_socket, "You are banned from channel: " + target + "\n");
+			return;
+		}
+		BufferRef line = (MessageBuilder() << clients[client_socket]->nickname << ": " << message << "\n").build();
+		send_to_channel(*channel, line, client_socket);
+		state.history.record(target, line.data(), line.size());
+		send_to_client(client_socket, (MessageBuilder() << "You: " << message << "\n").build());
+		if (!state.links.empty())
+			relay_to_channel(*channel, (MessageBuilder() << ":" << clients[client_socket]->uid
+				<< " PRIVMSG " << target << " :" << message << "\n").build(), -1);
 	} else {
-		for (std::map<int, std::string>::iterator it = nicknames.begin(); it != nicknames.end(); ++it) {
-			if (it->second == target) {
-				send_to_client(it->first, nicknames[client_socket] + " (private): " + message + "\n");
-				return;
-			}
+		int target_socket = nicknames.find(target);
+		if (target_socket != -1 && (size_t)target_socket >= state.remote_base) {
+			send_to_client(clients[target_socket]->link, (MessageBuilder() << ":" << clients[client_socket]->uid
+				<< " PRIVMSG " << clients[target_socket]->uid << " :" << message << "\n").build());
+			return;
+		}
+		if (target_socket != -1) {
+			send_to_client(target_socket,
+				(MessageBuilder() << clients[client_socket]->nickname << " (private): " << message << "\n").build());
+			return;
 		}
 		send_to_client(client_socket, "No such user: " + target + "\n");
 	}
 }
 
-void IRCServer::process_command(int client_socket, const std::string &command) {
-	std::istringstream iss(command);
-	std::string cmd;
-	iss >> cmd;
+// Verbs are matched case-insensitively through a switch on length and
+// first letter, so dispatch costs a couple of compares whatever the verb.
+// PRIVMSG only reads shared state so workers can broadcast in parallel.
+// The last column is the flood cost; broadcasts are also charged for
+// their fan-out in process_command.
+const IRCServer::CommandSpec IRCServer::command_table[] = {
+	{ "QUIT", &IRCServer::cmd_quit, ACCESS_ANY, StateLock::NONE, 0 },
+	{ "NICK", &IRCServer::cmd_nick, ACCESS_ANY, StateLock::WRITE, 2 },
+	{ "PASS", &IRCServer::cmd_pass, ACCESS_NICK, StateLock::WRITE, 1 },
+	{ "USER", &IRCServer::cmd_user, ACCESS_NICK, StateLock::WRITE, 1 },
+	{ "MODE", &IRCServer::cmd_mode, ACCESS_AUTH, StateLock::WRITE, 2 },
+	{ "JOIN", &IRCServer::cmd_join, ACCESS_AUTH, StateLock::WRITE, 2 },
+	{ "PRIVMSG", &IRCServer::cmd_privmsg, ACCESS_AUTH, StateLock::READ, 1 },
+	{ "KICK", &IRCServer::cmd_kick, ACCESS_AUTH, StateLock::WRITE, 2 },
+	{ "INVITE", &IRCServer::cmd_invite, ACCESS_AUTH, StateLock::WRITE, 2 },
+	{ "TOPIC", &IRCServer::cmd_topic, ACCESS_AUTH, StateLock::WRITE, 2 },
+	{ "OPER", &IRCServer::cmd_oper, ACCESS_AUTH, StateLock::WRITE, 2 },
+	{ "STATS", &IRCServer::cmd_stats, ACCESS_AUTH, StateLock::READ, 4 },
+	{ "CHATHISTORY", &IRCServer::cmd_chathistory, ACCESS_AUTH, StateLock::READ, 2 },
+	{ "PING", &IRCServer::cmd_ping, ACCESS_ANY, StateLock::NONE, 1 },
+	{ "PONG", &IRCServer::cmd_pong, ACCESS_ANY, StateLock::NONE, 0 },
+	{ "SERVER", &IRCServer::cmd_server, ACCESS_ANY, StateLock::WRITE, 0 },
+	{ "LIST", &IRCServer::cmd_list, ACCESS_AUTH, StateLock::READ, 4 },
+	{ "NAMES", &IRCServer::cmd_names, ACCESS_AUTH, StateLock::READ, 4 },
+	{ "WHO", &IRCServer::cmd_who, ACCESS_AUTH, StateLock::READ, 4 },
+};
+
+const size_t IRCServer::command_count = sizeof(command_table) / sizeof(command_table[0]);
+
+enum {
+	CMD_QUIT, CMD_NICK, CMD_PASS, CMD_USER, CMD_MODE,
+	CMD_JOIN, CMD_PRIVMSG, CMD_KICK, CMD_INVITE, CMD_TOPIC,
+	CMD_OPER, CMD_STATS, CMD_CHATHISTORY, CMD_PING, CMD_PONG,
+	CMD_SERVER, CMD_LIST, CMD_NAMES, CMD_WHO
+};
+
+static bool verb_is(const StringView &verb, const char *name) {
+	for (size_t i = 0; i < verb.size; i++) {
+		if (std::toupper((unsigned char)verb.data[i]) != name[i])
+			return false;
+	}
+	return name[verb.size] == '\0';
+}
 
-	if (cmd == "QUIT") {
-		remove_client(client_socket);
+const IRCServer::CommandSpec *IRCServer::find_command(const StringView &verb) {
+	int index = -1;
+	switch (verb.size) {
+		case 3: index = CMD_WHO; break;
+		case 4:
+			switch (std::toupper((unsigned char)verb.data[0])) {
+				case 'Q': index = CMD_QUIT; break;
+				case 'N': index = CMD_NICK; break;
+				case 'P':
+					switch (std::toupper((unsigned char)verb.data[1])) {
+						case 'A': index = CMD_PASS; break;
+						case 'I': index = CMD_PING; break;
+						case 'O': index = CMD_PONG; break;
+					}
+					break;
+				case 'U': index = CMD_USER; break;
+				case 'M': index = CMD_MODE; break;
+				case 'J': index = CMD_JOIN; break;
+				case 'K': index = CMD_KICK; break;
+				case 'O': index = CMD_OPER; break;
+				case 'L': index = CMD_LIST; break;
+			}
+			break;
+		case 5:
+			switch (std::toupper((unsigned char)verb.data[0])) {
+				case 'T': index = CMD_TOPIC; break;
+				case 'S': index = CMD_STATS; break;
+				case 'N': index = CMD_NAMES; break;
+			}
+			break;
+		case 6:
+			switch (std::toupper((unsigned char)verb.data[0])) {
+				case 'I': index = CMD_INVITE; break;
+				case 'S': index = CMD_SERVER; break;
+			}
+			break;
+		case 7: index = CMD_PRIVMSG; break;
+		case 11: index = CMD_CHATHISTORY; break;
 	}
-	
-	if (cmd == "NICK") {
-		std::string nickname;
-		iss >> nickname;
-		if (nickname.empty()) {
-			send_to_client(client_socket, "Invalid nickname\n");
-			return;
-		}
-		// Remove leading space if present
-		if (!nickname.empty() && nickname[0] == ' ') {
-			nickname = nickname.substr(1);
-		}
-		
-		if (is_nickname_taken(nickname)) {
-			send_to_client(client_socket, "Nickname is already taken\n");
-		} else {
-			nicknames[client_socket] = nickname;
-			send_to_client(client_socket, "Nickname set to " + nicknames[client_socket] + "\n");
-		}
+	if (index == -1 || !verb_is(verb, command_table[index].name))
+		return NULL;
+	return &command_table[index];
+}
+
+void IRCServer::process_command(int client_socket, const StringView &line) {
+	IrcMessage msg;
+	if (!msg.parse(line))
 		return;
+
+	// Timed per verb, lock waits included; unknown verbs share the last slot
+	unsigned long long started = monotonic_ns();
+	const CommandSpec *command = find_command(msg.command);
+	if (clients[client_socket]->capture_id)
+		capture_line(client_socket, line, msg, command);
+	if (log_enabled(LOG_DEBUG))
+		log_write(LOG_DEBUG, "command fd=%d nick=%s verb=%.*s params=%lu", client_socket,
+			clients[client_socket]->nickname.empty() ? "*" : clients[client_socket]->nickname.c_str(),
+			(int)msg.command.size, msg.command.data, (unsigned long)msg.param_count);
+	command_fanout = 0;
+	dispatch_command(client_socket, command, msg);
+	int slot = command ? command - command_table : MAX_COMMANDS - 1;
+	stat_add(stats.command_calls[slot], 1);
+	stats.command_ns[slot].record(monotonic_ns() - started);
+
+	Client &client = *clients[client_socket];
+	if (config.flood_rate > 0) {
+		long cost = (command ? command->cost : 1) * 1000L + command_fanout * 1000L / FLOOD_FANOUT_STEP;
+		client.tokens -= cost;
 	}
+	// Keepalives don't count as activity for the idle limit
+	if (slot != CMD_PING && slot != CMD_PONG)
+		client.last_command = timers.now();
+	if (client.liveness == Client::REGISTERING && client.state == Client::ACTIVE)
+		schedule_liveness(client);
+}
 
-	if (nicknames[client_socket] == "") {
+// Passwords never reach the trace, the replayer puts its own back
+void IRCServer::capture_line(int client_socket, const StringView &line, const IrcMessage &msg, const CommandSpec *command) {
+	unsigned connection = clients[client_socket]->capture_id;
+	int slot = command ? command - command_table : -1;
+	if (slot == CMD_PASS || (slot == CMD_OPER && msg.param_count > 1)) {
+		std::string redacted = std::string(command->name) + " ";
+		if (slot == CMD_OPER)
+			redacted += msg.param(0).str() + " ";
+		redacted += "*";
+		capture_append(capture_batch, connection, CAPTURE_LINE, redacted.data(), redacted.size());
+	} else {
+		capture_append(capture_batch, connection, CAPTURE_LINE, line.data, line.size);
+	}
+	if (capture_since == 0)
+		capture_since = monotonic_ns();
+}
+
+void IRCServer::capture_event(const Client &client, CaptureEvent event) {
+	capture_append(capture_batch, client.capture_id, event, "", 0);
+	if (capture_since == 0)
+		capture_since = monotonic_ns();
+}
+
+void IRCServer::dispatch_command(int client_socket, const CommandSpec *command, const IrcMessage &msg) {
+	int access = command ? command->access : ACCESS_AUTH;
+
+	Client &client = *clients[client_socket];
+	if (access >= ACCESS_NICK && !(client.registration & Client::REG_NICK)) {
 		send_to_client(client_socket, "You must define a nickname first.\n");
 		return;
 	}
-	
-	if (cmd == "PASS") {
-		std::string client_pass, other;
-		iss >> client_pass >> other;
-
-		if (other != "") {
-			send_to_client(client_socket, "Multiple passwords were given!\n");
-		} else if (authenticated_clients[client_socket] == true) {
-			send_to_client(client_socket, "You are already authenticated\n");
-		} else if (client_pass != password) {
-			send_to_client(client_socket, "Wrong password\n");
-		} else {
-			authenticated_clients[client_socket] = true;
-			send_to_client(client_socket, "Welcome to IRC server!\n");
-		}
+	// Check if authenticated
+	if (access >= ACCESS_AUTH && !client.authenticated()) {
+		send_to_client(client_socket, "You must authenticate first with PASS.\n");
 		return;
-	} else if (cmd == "USER") {
-		std::string username, hostname, servername, realname;
+	}
 
-		// Extract the username
-		if (!(iss >> username)) {
-			send_to_client(client_socket, "Invalid username\n");
-			return;
-		}
+	if (!command) {
+		send_to_client(client_socket, "Unknown command\n");
+		return;
+	}
+	StateLock guard(state, command->lock);
+	(this->*command->handler)(client_socket, msg);
+}
 
-		// Extract the hostname, servername, and realname if available
-		if (!(iss >> hostname >> servername)) {
-			send_to_client(client_socket, "Invalid USER command format\n");
-			return;
-		}
+void IRCServer::cmd_ping(int client_socket, const IrcMessage &msg) {
+	std::string token = msg.param(0).str();
+	if (token.empty()) {
+		send_to_client(client_socket, "No origin specified\n");
+		return;
+	}
+	send_to_client(client_socket, "PONG :" + token + "\n");
+}
+
+// Nothing to do, any input already proves the client is alive
+void IRCServer::cmd_pong(int client_socket, const IrcMessage &msg) {
+	(void)client_socket;
+	(void)msg;
+}
 
-		// Extract the realname, which may contain spaces (hence, using getline)
-		getline(iss, realname);
-		if (!realname.empty() && realname[0] == ' ') {
-			realname = realname.substr(1);  // Remove leading space
+void IRCServer::cmd_quit(int client_socket, const IrcMessage &msg) {
+	(void)msg;
+	schedule_close(client_socket, "Quit");
+}
+
+void IRCServer::cmd_nick(int client_socket, const IrcMessage &msg) {
+	std::string nickname = msg.param(0).str();
+	// A leading digit is left to uids, which take over a nickname lost in a collision
+	if (nickname.empty() || std::isdigit((unsigned char)nickname[0])) {
+		send_to_client(client_socket, "Invalid nickname\n");
+		return;
+	}
+
+	Client &client = *clients[client_socket];
+	if (!nicknames.claim(client_socket, client.nickname, nickname)) {
+		send_to_client(client_socket, "Nickname is already taken\n");
+	} else {
+		bool renamed = client.nickname != nickname;
+		client.nickname = nickname;
+		client.update_hostmask();
+		client.registration |= Client::REG_NICK;
+		assign_uid(client);
+		if (renamed)
+			client.nick_ts = time(NULL);
+		if (renamed && client.authenticated()) {
+			std::ostringstream line;
+			line << ":" << client.uid << " NICK " << nickname << " " << client.nick_ts << "\n";
+			send_to_links(line.str(), -1);
 		}
+		send_to_client(client_socket, "Nickname set to " + client.nickname + "\n");
+	}
+}
 
-		// Store the username (you can store hostname, servername, and realname if needed)
-		usernames[client_socket] = username;
+void IRCServer::cmd_pass(int client_socket, const IrcMessage &msg) {
+	Client &client = *clients[client_socket];
+	if (msg.param_count > 1) {
+		send_to_client(client_socket, "Multiple passwords were given!\n");
+	} else if (client.authenticated()) {
+		send_to_client(client_socket, "You are already authenticated\n");
+	} else if (msg.param(0).str() != password) {
+		log_write(LOG_WARN, "auth_failed fd=%d nick=%s reason=\"wrong password\"", client_socket, client.nickname.c_str());
+		send_to_client(client_socket, "Wrong password\n");
+	} else {
+		client.registration |= Client::REG_PASS;
+		introduce_user(client_socket);
+		send_to_client(client_socket, "Welcome to IRC server!\n");
+	}
+}
 
-		send_to_client(client_socket, "User information set. Welcome " + username + "!\n");
+void IRCServer::cmd_user(int client_socket, const IrcMessage &msg) {
+	// USER <username> <hostname> <servername> <realname>
+	if (msg.param_count < 1) {
+		send_to_client(client_socket, "Invalid username\n");
 		return;
 	}
-	
-	// Check if authenticated
-	if (authenticated_clients[client_socket] != true) {
-		send_to_client(client_socket, "You must authenticate first with PASS.\n");
+	if (msg.param_count < 3) {
+		send_to_client(client_socket, "Invalid USER command format\n");
 		return;
 	}
-	
-	if (cmd == "MODE") {
-		std::string channel, mode_string, argument;
-		iss >> channel >> mode_string;
 
-		if (channels.find(channel) == channels.end()) {
-			send_to_client(client_socket, "No such channel: " + channel + "\n");
-			return;
-		}
+	// Store the username (hostname, servername and realname are not used yet)
+	Client &client = *clients[client_socket];
+	client.username = msg.param(0).str();
+	client.update_hostmask();
+	client.registration |= Client::REG_USER;
+
+	send_to_client(client_socket, "User information set. Welcome " + client.username + "!\n");
+}
 
-		ChannelMode &chan_mode = channel_modes[channel];
-		bool is_operator = chan_mode.operators.find(client_socket) != chan_mode.operators.end();
+void IRCServer::cmd_mode(int client_socket, const IrcMessage &msg) {
+	std::string channel = msg.param(0).str();
+	Channel *chan = state.find_channel(channel);
 
+	if (!chan) {
+		send_to_client(client_socket, "No such channel: " + channel + "\n");
+		return;
+	}
+
+	if (!chan->is_operator(client_socket)) {
+		send_to_client(client_socket, "You are not an operator of channel: " + channel + "!\n");
+		return ;
+	}
+	change_modes(client_socket, *chan, msg);
+	send_to_links(mode_line(*chan, client_socket), -1);
+}
 
-		if (!is_operator) {
-			send_to_client(client_socket, "You are not an operator of channel: " + channel + "!\n");
-			return ;
+void IRCServer::change_modes(int client_socket, Channel &chan, const IrcMessage &msg) {
+	StringView mode_string = msg.param(1);
+	size_t next_argument = 2;
+	const std::string &channel = chan.name;
+	bool adding = true; // Determine if we're adding or removing modes
+	for (size_t i = 0; i < mode_string.size; i++) {
+		char c = mode_string.data[i];
+		if (c == '+') {
+			adding = true;
+			continue;
+		} else if (c == '-') {
+			adding = false;
+			continue;
 		}
-		bool adding = true; // Determine if we're adding or removing modes
-		for (size_t i = 0; i < mode_string.length(); i++) {
-			char c = mode_string[i];
-			if (c == '+') {
-				adding = true;
-				continue;
-			} else if (c == '-') {
-				adding = false;
-				continue;
-			}
 
-			switch (c) {
-				case 'i':
-					chan_mode.invite_only = adding;
-					send_to_client(client_socket, adding ? "Channel is invite-only!\n" : "Channel is not invite-only!\n");
-					break;
+		std::string argument;
+		int target_socket;
+		switch (c) {
+			case 'i':
+				chan.invite_only = adding;
+				send_to_client(client_socket, adding ? "Channel is invite-only!\n" : "Channel is not invite-only!\n");
+				break;
 
-				case 't':
-					chan_mode.topic_restricted = adding;
-					send_to_client(client_socket, adding ? "Channel is topic-restricted!\n" : "Channel is not topic-restricted!\n");
-					break;
+			case 't':
+				chan.topic_restricted = adding;
+				send_to_client(client_socket, adding ? "Channel is topic-restricted!\n" : "Channel is not topic-restricted!\n");
+				break;
 
-				case 'k':
+			case 'k':
+				if (adding) {
+					argument = msg.param(next_argument++).str();
+					chan.key = argument;
+					send_to_client(client_socket, "Channel password set!\n");
+				} else {
+					chan.key.clear();
+					send_to_client(client_socket, "No password for this channel!\n");
+				}
+				break;
+
+			case 'o':
+				argument = msg.param(next_argument++).str();
+				target_socket = nicknames.find(argument);
+				if (target_socket != -1) {
+					if (clients[target_socket]->authenticated())
+						send_to_links(":" + clients[client_socket]->uid + " CHANOP " + channel + " "
+							+ clients[target_socket]->uid + (adding ? " +\n" : " -\n"), -1);
 					if (adding) {
-						iss >> argument;
-						chan_mode.key = argument;
-						send_to_client(client_socket, "Channel password set!\n");
-					} else {
-						chan_mode.key.clear();
-						send_to_client(client_socket, "No password for this channel!\n");
+						set_operator(chan, target_socket, true);
+						send_to_client(target_socket, clients[client_socket]->nickname + " added you as an operator of channel: " + channel + "\n");
 					}
-					break;
-
-				case 'o':
-					if (is_operator) {
-						iss >> argument;
-
-						int target_socket = -1;
-						std::map<int, std::string>::iterator nick_it;
-						for (nick_it = nicknames.begin(); nick_it != nicknames.end(); ++nick_it) {
-							if (nick_it->second == argument) {
-								target_socket = nick_it->first;
-								break;
-							}
-						}
-
-						if (target_socket != -1) {
-							if (adding) {
-								chan_mode.operators.insert(target_socket);
-								send_to_client(target_socket, nicknames[client_socket] + " added you as an operator of channel: " + channel + "\n");
-							}
-							else {
-								chan_mode.operators.erase(target_socket);
-								send_to_client(target_socket, nicknames[client_socket] + " remove you from the operators of channel: " + channel + "\n");
-							}
-						} else {
-							send_to_client(client_socket, "No such user: " + argument + "\n");
-						}
-					} else {
-						send_to_client(client_socket, "You are not an operator in this channel.\n");
+					else {
+						set_operator(chan, target_socket, false);
+						send_to_client(target_socket, clients[client_socket]->nickname + " remove you from the operators of channel: " + channel + "\n");
 					}
-					break;
+				} else {
+					send_to_client(client_socket, "No such user: " + argument + "\n");
+				}
+				break;
 
-				case 'l':
-					if (adding) {
-						iss >> argument;
-						if (argument.empty()) {
-							send_to_client(client_socket, "Error: No limit given.\n");
-							return ;
-						}
-						int new_limit = std::atoi(argument.c_str());
-						
-						// Check if the new limit is less than the current number of members
-						if (new_limit < 1 || new_limit > 100) {
-							send_to_client(client_socket, "Error: User limit not in range [1-100].\n");
-							return ;
-						} else if (new_limit < static_cast<int>(channels[channel].size())) {
-							send_to_client(client_socket, "Error: User limit cannot be less than the current number of members.\n");
-							return ;
-						} else {
-							chan_mode.user_limit = new_limit;
-							send_to_channel(channel, "User limit for channel " + channel + " set to " + argument + "\n", client_socket);
-						}
+			case 'b':
+			case 'e':
+			case 'I':
+				argument = msg.param(next_argument++).str();
+				if (argument.empty())
+					send_mask_list(client_socket, chan, c);
+				else
+					change_mask(client_socket, chan, c, adding, argument);
+				break;
+
+			case 'l':
+				if (adding) {
+					argument = msg.param(next_argument++).str();
+					if (argument.empty()) {
+						send_to_client(client_socket, "Error: No limit given.\n");
+						return ;
+					}
+					int new_limit = std::atoi(argument.c_str());
+
+					// Check if the new limit is less than the current number of members
+					if (new_limit < 1 || new_limit > 100) {
+						send_to_client(client_socket, "Error: User limit not in range [1-100].\n");
+						return ;
+					} else if (new_limit < static_cast<int>(chan.members.size())) {
+						send_to_client(client_socket, "Error: User limit cannot be less than the current number of members.\n");
+						return ;
 					} else {
-						chan_mode.user_limit = 0;
-						send_to_channel(channel, "User limit for channel " + channel + " removed\n", client_socket);
+						chan.user_limit = new_limit;
+						send_to_channel(chan, "User limit for channel " + channel + " set to " + argument + "\n", client_socket);
 					}
-					break;
-				default:
-					send_to_client(client_socket, "Unknown mode: " + std::string(1, c) + "\n");
-					break;
-			}
-		}
-	} else if (cmd == "JOIN") {
-		std::string channel_name, channel_password;
-		iss >> channel_name >> channel_password;
-		if (channel_name.empty() || channel_name[0] != '#') {
-			send_to_client(client_socket, "Invalid channel name\n");
-			return;
-		}
-		join_channel(client_socket, channel_name, channel_password);
-	} else if (cmd == "PRIVMSG") {
-		std::string target, msg;
-		iss >> target;
-		getline(iss, msg);
-		if (msg.empty()) {
-			send_to_client(client_socket, "No message to send\n");
-			return;
-		}
-		if (!msg.empty() && msg[0] == ' ')
-			msg = msg.substr(1);
-		handle_privmsg(client_socket, target, msg);
-	} else if (cmd == "KICK") {
-		std::string channel, user;
-		iss >> channel >> user;
-
-		// Check if the channel exists
-		if (channels.find(channel) == channels.end()) {
-			send_to_client(client_socket, "No such channel: " + channel + "\n");
-			return;
+				} else {
+					chan.user_limit = 0;
+					send_to_channel(chan, "User limit for channel " + channel + " removed\n", client_socket);
+				}
+				break;
+			default:
+				send_to_client(client_socket, "Unknown mode: " + std::string(1, c) + "\n");
+				break;
 		}
+	}
+}
 
-		ChannelMode &chan_mode = channel_modes[channel];
+void IRCServer::cmd_join(int client_socket, const IrcMessage &msg) {
+	std::string channel_name = msg.param(0).str();
+	if (channel_name.empty() || channel_name[0] != '#') {
+		send_to_client(client_socket, "Invalid channel name\n");
+		return;
+	}
+	join_channel(client_socket, channel_name, msg.param(1).str());
+}
 
-		// Check if the client issuing the KICK command is an operator
-		if (chan_mode.operators.find(client_socket) == chan_mode.operators.end()) {
-			send_to_client(client_socket, "You are not an operator in this channel.\n");
-			return;
-		}
+void IRCServer::cmd_privmsg(int client_socket, const IrcMessage &msg) {
+	if (msg.param_count < 2) {
+		send_to_client(client_socket, "No message to send\n");
+		return;
+	}
+	handle_privmsg(client_socket, msg.param(0).str(), msg.rest(1));
+}
 
-		// Find the target user's socket
-		int target_socket = -1;
-		for (std::map<int, std::string>::iterator it = nicknames.begin(); it != nicknames.end(); ++it) {
-			if (it->second == user) {
-				target_socket = it->first;
-				break;
-			}
-		}
+void IRCServer::cmd_kick(int client_socket, const IrcMessage &msg) {
+	std::string channel = msg.param(0).str();
+	std::string user = msg.param(1).str();
 
-		if (target_socket == -1) {
-			send_to_client(client_socket, "No such user: " + user + "\n");
-			return;
-		}
+	// Check if the channel exists
+	Channel *chan = state.find_channel(channel);
+	if (!chan) {
+		send_to_client(client_socket, "No such channel: " + channel + "\n");
+		return;
+	}
 
-		// Check if the user is in the channel
-		if (channels[channel].find(target_socket) == channels[channel].end()) {
-			send_to_client(client_socket, user + " is not in channel " + channel + "\n");
-			return;
-		}
+	// Check if the client issuing the KICK command is an operator
+	if (!chan->is_operator(client_socket)) {
+		send_to_client(client_socket, "You are not an operator in this channel.\n");
+		return;
+	}
 
-		if (target_socket == client_socket) {
-			send_to_client(client_socket, "You cannot remove yourself from operators list!\n");
-			return ;
-		}
-		// Remove the user from the channel
-		channels[channel].erase(target_socket);
+	// Find the target user's socket
+	int target_socket = nicknames.find(user);
 
-		// Notify the channel that the user was kicked
-		send_to_channel(channel, user + " has been kicked by " + nicknames[client_socket] + "\n", client_socket);
+	if (target_socket == -1) {
+		send_to_client(client_socket, "No such user: " + user + "\n");
+		return;
+	}
 
-		// Notify the kicked user
-		send_to_client(target_socket, "You have been kicked from channel " + channel + "\n");
-	} else if (cmd == "INVITE") {
-		std::string user, channel;
-		iss >> user >> channel;
+	// Check if the user is in the channel
+	if (!chan->has_member(target_socket)) {
+		send_to_client(client_socket, user + " is not in channel " + channel + "\n");
+		return;
+	}
 
-		// Check if the channel exists
-		if (channels.find(channel) == channels.end()) {
-			send_to_client(client_socket, "No such channel: " + channel + "\n");
-			return;
-		}
+	if (target_socket == client_socket) {
+		send_to_client(client_socket, "You cannot remove yourself from operators list!\n");
+		return ;
+	}
+	// Remove the user from the channel
+	remove_member(*chan, target_socket);
 
-		ChannelMode &chan_mode = channel_modes[channel];
+	// Notify the channel that the user was kicked
+	send_to_channel(*chan, user + " has been kicked by " + clients[client_socket]->nickname + "\n", client_socket);
 
-		// Check if it is full
-		if (chan_mode.user_limit > 0 && channels[channel].size() >= (size_t)chan_mode.user_limit) {
-			send_to_client(client_socket, "Cannot invite anyone as channel is full\n");
-			return;
-		}
-		
-		// Check if the client issuing the INVITE command is an operator
-		if (chan_mode.operators.find(client_socket) == chan_mode.operators.end()) {
-			send_to_client(client_socket, "You are not an operator in this channel.\n");
-			return;
-		}
+	// Notify the kicked user
+	send_to_client(target_socket, "You have been kicked from channel " + channel + "\n");
+	if (clients[target_socket]->authenticated())
+		send_to_links(":" + clients[client_socket]->uid + " KICK " + channel + " " + clients[target_socket]->uid + "\n", -1);
+	reclaim_channel(*chan);
+}
 
-		// Find the target user's socket
-		int target_socket = -1;
-		for (std::map<int, std::string>::iterator it = nicknames.begin(); it != nicknames.end(); ++it) {
-			if (it->second == user) {
-				target_socket = it->first;
-				break;
-			}
-		}
+void IRCServer::cmd_invite(int client_socket, const IrcMessage &msg) {
+	std::string user = msg.param(0).str();
+	std::string channel = msg.param(1).str();
 
-		if (target_socket == -1) {
-			send_to_client(client_socket, "No such user: " + user + "\n");
-			return;
-		}
+	// Check if the channel exists
+	Channel *chan = state.find_channel(channel);
+	if (!chan) {
+		send_to_client(client_socket, "No such channel: " + channel + "\n");
+		return;
+	}
 
-		// Add the user to the channel (if the channel is invite-only)
-		if (chan_mode.invite_only) {
-			channels[channel].insert(target_socket);
-			send_to_client(target_socket, "You have been invited to channel " + channel + " by " + nicknames[client_socket] + "\n");
-			send_to_channel(channel, user + " has been invited to the channel by " + nicknames[client_socket] + "\n", client_socket);
-		} else {
-			send_to_client(client_socket, "Channel " + channel + " is not invite-only.\n");
-		}
+	// Check if it is full
+	if (chan->user_limit > 0 && chan->members.size() >= (size_t)chan->user_limit) {
+		send_to_client(client_socket, "Cannot invite anyone as channel is full\n");
+		return;
 	}
-	else if (cmd == "TOPIC") {
-		std::string channel, topic;
-		iss >> channel;
-		getline(iss, topic);
-		if (!topic.empty() && topic[0] == ' ')
-			topic = topic.substr(1);
-		ChannelMode &chan_mode = channel_modes[channel];
-		// Check if the channel exists
-		if (channels.find(channel) == channels.end()) {
-			send_to_client(client_socket, "No such channel: " + channel + "\n");
-			return;
-		}
-		// Check if the user is an operator if the channel has topic restriction
-		if (chan_mode.topic_restricted && chan_mode.operators.find(client_socket) == chan_mode.operators.end()) {
-			send_to_client(client_socket, "You're not allowed to set the topic\n");
-			return;
-		}
-		// Set the topic and notify the channel
-		// Assuming a map to store topics exists: channel_topics[channel] = topic;
-		send_to_channel(channel, "Topic for channel " + channel + " set to: " + topic + "\n", client_socket);
+
+	// Check if the client issuing the INVITE command is an operator
+	if (!chan->is_operator(client_socket)) {
+		send_to_client(client_socket, "You are not an operator in this channel.\n");
+		return;
+	}
+
+	// Find the target user's socket
+	int target_socket = nicknames.find(user);
+
+	if (target_socket == -1) {
+		send_to_client(client_socket, "No such user: " + user + "\n");
+		return;
+	}
+
+	// Add the user to the channel (if the channel is invite-only)
+	if (chan->invite_only) {
+		add_member(*chan, target_socket);
+		send_to_client(target_socket, "You have been invited to channel " + channel + " by " + clients[client_socket]->nickname + "\n");
+		send_to_channel(*chan, user + " has been invited to the channel by " + clients[client_socket]->nickname + "\n", client_socket);
+		if (clients[target_socket]->authenticated())
+			send_to_links(":" + clients[client_socket]->uid + " INVITE " + clients[target_socket]->uid + " " + channel + "\n", -1);
 	} else {
-		send_to_client(client_socket, "Unknown command\n");
+		send_to_client(client_socket, "Channel " + channel + " is not invite-only.\n");
+	}
+}
+
+void IRCServer::cmd_topic(int client_socket, const IrcMessage &msg) {
+	std::string channel = msg.param(0).str();
+	std::string topic = msg.rest(1).str();
+	// Check if the channel exists
+	Channel *chan = state.find_channel(channel);
+	if (!chan) {
+		send_to_client(client_socket, "No such channel: " + channel + "\n");
+		return;
 	}
-}
\ No newline at end of file
+	// Check if the user is an operator if the channel has topic restriction
+	if (chan->topic_restricted && !chan->is_operator(client_socket)) {
+		send_to_client(client_socket, "You're not allowed to set the topic\n");
+		return;
+	}
+	// Set the topic and notify the channel
+	chan->topic = topic;
+	send_to_channel(*chan, "Topic for channel " + channel + " set to: " + topic + "\n", client_socket);
+	relay_to_channel(*chan, BufferRef(":" + clients[client_socket]->uid + " TOPIC " + channel + " :" + topic + "\n"), -1);
+}
+
+void IRCServer::cmd_oper(int client_socket, const IrcMessage &msg) {
+	// OPER <name> <password>, the name is not checked
+	if (msg.param_count < 2) {
+		send_to_client(client_socket, "Usage: OPER <name> <password>\n");
+		return;
+	}
+	if (config.oper_password.empty() || msg.param(1).str() != config.oper_password) {
+		log_write(LOG_WARN, "oper_failed fd=%d nick=%s", client_socket, clients[client_socket]->nickname.c_str());
+		send_to_client(client_socket, "Password incorrect\n");
+		return;
+	}
+	clients[client_socket]->oper = true;
+	log_write(LOG_INFO, "oper fd=%d nick=%s", client_socket, clients[client_socket]->nickname.c_str());
+	send_to_client(client_socket, "You are now an IRC operator\n");
+}
+
+static void describe(std::ostream &out, const Histogram &histogram, const char *unit) {
+	out << "p50 " << histogram.percentile(0.50) << unit
+		<< ", p99 " << histogram.percentile(0.99) << unit
+		<< ", max " << histogram.max << unit;
+}
+
+void IRCServer::cmd_stats(int client_socket, const IrcMessage &msg) {
+	(void)msg;
+	if (!clients[client_socket]->oper) {
+		send_to_client(client_socket, "Permission denied, you are not an IRC operator\n");
+		return;
+	}
+
+	Stats total;
+	collect_stats(total);
+	std::ostringstream out;
+	out << "Uptime: " << (monotonic_ns() - state.started) / 1000000000ULL << "s, workers: " << config.workers
+		<< ", clients: " << total.accepted - total.disconnected << ", channels: " << channels.size() << "\n";
+	out << "Traffic: " << total.bytes_in << " bytes in, " << total.bytes_out << " bytes out, "
+		<< total.messages_out << " messages in " << total.sends << " sends\n";
+	out << "Wakeups: " << total.wakeups << ", ready fds ";
+	describe(out, total.ready_per_wakeup, "");
+	out << "\nFan-out: " << total.fanout.count << " broadcasts, recipients ";
+	describe(out, total.fanout, "");
+	out << "\n";
+	if (allocation_count() >= 0)
+		out << "Allocations: " << allocation_count() << "\n";
+	out << "Log lines dropped: " << log_dropped() << "\n";
+	if (!state.servers.empty())
+		out << "Network: " << config.server_name << " linked to " << state.links.size() << " of "
+			<< state.servers.size() << " servers, remote users: "
+			<< MAX_REMOTE_USERS - state.remote_free.size() << "\n";
+	for (size_t i = 0; i < MAX_COMMANDS; i++) {
+		if (total.command_calls[i] == 0)
+			continue;
+		out << (i < command_count ? command_table[i].name : "unknown") << ": " << total.command_calls[i] << " calls, ";
+		describe(out, total.command_ns[i], "ns");
+		out << "\n";
+	}
+	for (size_t i = 0; i < state.workers.size(); i++) {
+		const Stats &worker = state.workers[i]->statistics();
+		out << "Worker " << i << ": " << stat_load(worker.accepted) - stat_load(worker.disconnected) << " clients, "
+			<< stat_load(worker.wakeups) << " wakeups, " << stat_load(worker.bytes_in) << " bytes in, "
+			<< stat_load(worker.bytes_out) << " bytes out\n";
+	}
+	out << "End of STATS\n";
+	send_to_client(client_socket, out.str());
+}
+
+void IRCServer::cmd_chathistory(int client_socket, const IrcMessage &msg) {
+	// CHATHISTORY <channel> [count]
+	std::string channel = msg.param(0).str();
+	Channel *chan = state.find_channel(channel);
+	if (!chan || !chan->has_member(client_socket)) {
+		send_to_client(client_socket, "You are not in the channel: " + channel + "\n");
+		return;
+	}
+	size_t wanted = config.history_lines;
+	if (msg.param_count > 1 && std::atoi(msg.param(1).str().c_str()) > 0)
+		wanted = std::min((size_t)std::atoi(msg.param(1).str().c_str()), wanted);
+	if (send_history(client_socket, channel, wanted) == 0)
+		send_to_client(client_socket, "No history for channel " + channel + "\n");
+}
@@ -0,0 +1,452 @@
+#include "../ircserv.hpp"
+
+#include <sys/un.h>
+#include <stdint.h>
+#include <ctime>
+
+#define HANDOFF_MAGIC 0x49524348 // "IRCH"
+#define HANDOFF_VERSION 3
+
+// Snapshot encoding: little-endian integers and length-prefixed strings.
+// Clients are referred to by their position in the snapshot, since the
+// new process receives the sockets under different numbers.
+
+class SnapshotWriter {
+	public:
+		std::string data;
+
+		void u32(uint32_t value) {
+			for (int i = 0; i < 4; i++)
+				data += (char)((value >> (8 * i)) & 0xff);
+		}
+
+		void bytes(const char *bytes, size_t length) {
+			u32(length);
+			data.append(bytes, length);
+		}
+
+		void str(const std::string &value) {
+			bytes(value.data(), value.size());
+		}
+};
+
+class SnapshotReader {
+	private:
+		const std::string &data;
+		size_t offset;
+
+	public:
+		bool ok;
+
+		explicit SnapshotReader(const std::string &data) : data(data), offset(0), ok(true) {}
+
+		uint32_t u32() {
+			if (data.size() - offset < 4) {
+				ok = false;
+				return 0;
+			}
+			uint32_t value = 0;
+			for (int i = 0; i < 4; i++)
+				value |= (uint32_t)(unsigned char)data[offset++] << (8 * i);
+			return value;
+		}
+
+		std::string str() {
+			size_t length = u32();
+			if (!ok || data.size() - offset < length) {
+				ok = false;
+				return std::string();
+			}
+			offset += length;
+			return data.substr(offset - length, length);
+		}
+};
+
+static bool write_all(int fd, const char *data, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		data += written;
+		length -= written;
+	}
+	return true;
+}
+
+static bool read_all(int fd, char *data, size_t length) {
+	while (length > 0) {
+		ssize_t got = read(fd, data, length);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return false;
+		data += got;
+		length -= got;
+	}
+	return true;
+}
+
+static bool fill_address(const std::string &path, struct sockaddr_un &address) {
+	if (path.size() >= sizeof(address.sun_path))
+		return false;
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+// Descriptors travel in batches, each riding on a single byte of data
+static bool send_fds(int connection, const std::vector<int> &fds) {
+	for (size_t first = 0; first < fds.size(); first += HANDOFF_FDS_PER_MESSAGE) {
+		size_t count = std::min(fds.size() - first, (size_t)HANDOFF_FDS_PER_MESSAGE);
+		std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+		char byte = 0;
+		struct iovec iov;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &control[0];
+		msg.msg_controllen = control.size();
+		struct cmsghdr *header = CMSG_FIRSTHDR(&msg);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_RIGHTS;
+		header->cmsg_len = CMSG_LEN(count * sizeof(int));
+		std::memcpy(CMSG_DATA(header), &fds[first], count * sizeof(int));
+
+		if (sendmsg(connection, &msg, 0) != 1)
+			return false;
+	}
+	return true;
+}
+
+static bool receive_fds(int connection, size_t count, std::vector<int> &fds) {
+	while (fds.size() < count) {
+		size_t batch = std::min(count - fds.size(), (size_t)HANDOFF_FDS_PER_MESSAGE);
+		std::vector<char> control(CMSG_SPACE(batch * sizeof(int)));
+		char byte;
+		struct iovec iov;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &control[0];
+		msg.msg_controllen = control.size();
+		if (recvmsg(connection, &msg, MSG_CMSG_CLOEXEC) != 1 || (msg.msg_flags & MSG_CTRUNC))
+			return false;
+
+		struct cmsghdr *header = CMSG_FIRSTHDR(&msg);
+		if (!header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+			return false;
+		size_t received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const int *data = reinterpret_cast<const int *>(CMSG_DATA(header));
+		fds.insert(fds.end(), data, data + received);
+	}
+	return true;
+}
+
+int open_handoff_socket(const std::string &path) {
+	struct sockaddr_un address;
+	if (!fill_address(path, address))
+		return -1;
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0)
+		return -1;
+	// A predecessor's socket file is stale once we got this far
+	unlink(path.c_str());
+	if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 1) < 0) {
+		close(listener);
+		return -1;
+	}
+	fcntl(listener, F_SETFD, FD_CLOEXEC);
+	return listener;
+}
+
+// Runs once every worker has stopped. Returns true if the successor took
+// over, the caller then exits without touching the clients.
+bool send_handoff(ServerState &state, int connection) {
+	// Cross-worker mail still in flight belongs in the output queues
+	bool pending = true;
+	while (pending) {
+		pending = false;
+		for (size_t i = 0; i < state.workers.size(); i++)
+			pending = state.workers[i]->wake_workers() || pending;
+		for (size_t i = 0; i < state.workers.size(); i++)
+			state.workers[i]->deliver_mail();
+	}
+
+	std::vector<int> fds;
+	for (size_t i = 0; i < state.workers.size(); i++)
+		fds.push_back(state.workers[i]->listener());
+
+	SnapshotWriter out;
+	out.u32(HANDOFF_MAGIC);
+	out.u32(HANDOFF_VERSION);
+	out.u32(state.workers.size());
+
+	std::vector<int> index(state.clients.size(), -1);
+	std::vector<int> sockets;
+	for (size_t fd = 0; fd < state.clients.size(); fd++) {
+		// Links and the users behind them are rebuilt once the successor relinks
+		if (state.clients[fd] && state.clients[fd]->state == Client::ACTIVE && state.clients[fd]->kind == Client::LOCAL) {
+			index[fd] = sockets.size();
+			sockets.push_back(fd);
+		}
+	}
+	out.u32(sockets.size());
+	for (size_t i = 0; i < sockets.size(); i++) {
+		const Client &client = *state.clients[sockets[i]];
+		out.u32(client.registration);
+		out.u32(client.oper);
+		out.str(client.nickname);
+		out.str(client.username);
+		out.bytes(reinterpret_cast<const char *>(&client.address), sizeof(client.address));
+		StringView pending = client.input.pending();
+		std::string input(pending.data, pending.size);
+		input += client.unread;
+		out.str(input);
+		std::string output;
+		for (SendQueue::Chunks::const_iterator chunk = client.output.chunks.begin();
+				chunk != client.output.chunks.end(); ++chunk) {
+			size_t skip = (chunk == client.output.chunks.begin()) ? client.output.offset : 0;
+			output.append(chunk->data() + skip, chunk->size() - skip);
+		}
+		out.str(output);
+		fds.push_back(sockets[i]);
+	}
+
+	// Remote members are written too and dropped on the other side, like
+	// departed clients
+	out.u32(state.directory.size());
+	for (ChannelDirectory::iterator it = state.directory.begin(); it != state.directory.end(); ++it) {
+		Channel &channel = *it->second;
+		out.str(channel.name);
+		out.u32(channel.invite_only);
+		out.u32(channel.topic_restricted);
+		out.str(channel.key);
+		out.u32(channel.user_limit);
+		out.str(channel.topic);
+		for (const char *mode = "beI"; *mode; mode++) {
+			const MaskList &list = *channel.masks(*mode);
+			out.u32(list.size());
+			for (size_t j = 0; j < list.size(); j++)
+				out.str(list.mask(j));
+		}
+		out.u32(channel.members.size());
+		for (size_t j = 0; j < channel.members.size(); j++)
+			out.u32(index[channel.members[j]]);
+		out.u32(channel.operators.size());
+		for (size_t j = 0; j < channel.operators.size(); j++)
+			out.u32(index[channel.operators[j]]);
+	}
+
+	SnapshotWriter header;
+	header.u32(out.data.size());
+	header.u32(fds.size());
+	if (!write_all(connection, header.data.data(), header.data.size())
+		|| !write_all(connection, out.data.data(), out.data.size())
+		|| !send_fds(connection, fds))
+		return false;
+
+	// The successor answers once it serves everything it was given
+	struct pollfd ack;
+	ack.fd = connection;
+	ack.events = POLLIN;
+	char byte = 0;
+	return poll(&ack, 1, HANDOFF_ACK_TIMEOUT) == 1 && read(connection, &byte, 1) == 1 && byte == 1;
+}
+
+// Fills the freshly built state from the predecessor at `path` and hands
+// back its listening sockets. Returns the connection to acknowledge on,
+// or -1 if nothing could be taken over.
+int receive_handoff(ServerState &state, const std::string &path, std::vector<int> &listeners) {
+	struct sockaddr_un address;
+	if (!fill_address(path, address))
+		return -1;
+	int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (connection < 0)
+		return -1;
+	if (connect(connection, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		close(connection);
+		return -1;
+	}
+
+	char sizes[8];
+	std::string data;
+	std::vector<int> fds;
+	if (read_all(connection, sizes, sizeof(sizes))) {
+		SnapshotReader header(std::string(sizes, sizeof(sizes)));
+		data.resize(header.u32());
+		size_t fd_count = header.u32();
+		if (!(data.empty() || read_all(connection, &data[0], data.size()))
+			|| !receive_fds(connection, fd_count, fds)) {
+			for (size_t i = 0; i < fds.size(); i++)
+				close(fds[i]);
+			close(connection);
+			return -1;
+		}
+	}
+
+	SnapshotReader in(data);
+	size_t listener_count = 0;
+	if (in.u32() != HANDOFF_MAGIC || in.u32() != HANDOFF_VERSION
+		|| (listener_count = in.u32()) > fds.size()) {
+		for (size_t i = 0; i < fds.size(); i++)
+			close(fds[i]);
+		close(connection);
+		return -1;
+	}
+	listeners.assign(fds.begin(), fds.begin() + listener_count);
+
+	// Clients are spread over this process's workers round-robin
+	std::vector<int> sockets;
+	size_t client_count = in.u32();
+	for (size_t i = 0; i < client_count && in.ok; i++) {
+		int fd = (listener_count + i < fds.size()) ? fds[listener_count + i] : -1;
+		unsigned registration = in.u32();
+		bool oper = in.u32();
+		std::string nickname = in.str();
+		std::string username = in.str();
+		std::string peer = in.str();
+		std::string input = in.str();
+		std::string output = in.str();
+		if (fd < 0 || (size_t)fd >= state.remote_base || peer.size() != sizeof(struct sockaddr_in)) {
+			if (fd >= 0)
+				close(fd);
+			sockets.push_back(-1);
+			continue;
+		}
+
+		if (!state.clients[fd])
+			state.clients[fd] = new Client();
+		Client &client = *state.clients[fd];
+		struct sockaddr_in client_addr;
+		std::memcpy(&client_addr, peer.data(), sizeof(client_addr));
+		client.open(fd, client_addr, i % state.config.workers);
+		client.registration = registration;
+		client.oper = oper;
+		client.nickname = nickname;
+		client.username = username;
+		client.update_hostmask();
+		if (registration & Client::REG_NICK)
+			state.nicknames.claim(fd, "", nickname);
+		// Whatever does not fit waits in unread, fed once the lines before it ran
+		InputBuffer &buffer = client.input;
+		size_t length = std::min(input.size(), buffer.write_space());
+		std::memcpy(buffer.write_ptr(), input.data(), length);
+		buffer.commit(length);
+		client.unread.assign(input, length, std::string::npos);
+		if (!output.empty()) {
+			client.output.chunks.push_back(BufferRef(output));
+			client.output.bytes = output.size();
+		}
+		client.tokens = state.config.flood_burst * 1000;
+		client.refilled = monotonic_ns();
+		state.connections++;
+		sockets.push_back(fd);
+	}
+
+	size_t channel_count = in.u32();
+	for (size_t i = 0; i < channel_count && in.ok; i++) {
+		std::string name = in.str();
+		if (state.find_channel(name)) {
+			in.ok = false;
+			break;
+		}
+		Channel &channel = *state.create_channel(name);
+		channel.invite_only = in.u32();
+		channel.topic_restricted = in.u32();
+		channel.key = in.str();
+		channel.user_limit = in.u32();
+		channel.topic = in.str();
+		for (const char *mode = "beI"; *mode; mode++) {
+			size_t mask_count = in.u32();
+			for (size_t j = 0; j < mask_count && in.ok; j++)
+				channel.masks(*mode)->add(in.str());
+		}
+		for (int pass = 0; pass < 2; pass++) {
+			size_t count = in.u32();
+			for (size_t j = 0; j < count && in.ok; j++) {
+				size_t member = in.u32();
+				if (member >= sockets.size() || sockets[member] < 0)
+					continue;
+				if (pass == 0)
+					channel.add_member(sockets[member]);
+				else
+					channel.add_operator(sockets[member]);
+				state.clients[sockets[member]]->channels.insert(&channel);
+			}
+		}
+		// Only remote users were left in it
+		if (channel.members.empty()) {
+			for (size_t j = 0; j < channel.operators.size(); j++)
+				state.clients[channel.operators[j]]->channels.erase(&channel);
+			state.destroy_channel(&channel);
+		}
+	}
+
+	// Sockets the snapshot did not account for
+	for (size_t i = listener_count + client_count; i < fds.size(); i++)
+		close(fds[i]);
+	if (!in.ok)
+		log_write(LOG_ERROR, "handoff_truncated");
+	return connection;
+}
+
+// Worker 0, a successor connected to the handoff socket: stop every
+// worker so the state holds still while it is copied
+void IRCServer::begin_handoff() {
+	int connection = accept(handoff_socket, NULL, NULL);
+	if (connection < 0)
+		return;
+	if (state.handoff_connection >= 0) {
+		close(connection);
+		return;
+	}
+	fcntl(connection, F_SETFD, FD_CLOEXEC);
+	state.handoff_connection = connection;
+	live = false;
+	log_write(LOG_INFO, "handoff_start");
+}
+
+int IRCServer::listener() const {
+	return server_socket;
+}
+
+// Registers the clients a predecessor handed over to this worker. Their
+// buffered input may hold complete lines, so they start in the backlog
+// and service_backlog runs those lines before reading resumes.
+void IRCServer::adopt_clients() {
+	for (size_t fd = 0; fd < clients.size(); fd++) {
+		Client *client = clients[fd];
+		if (!client || client->owner() != worker_id || client->state != Client::ACTIVE)
+			continue;
+		stat_add(stats.accepted, 1);
+		// Unwatched it could never be read or reaped, hang up instead of
+		// keeping its nickname and channels forever
+		if (!poller->add(fd, 0)) {
+			log_write(LOG_ERROR, "watch_failed fd=%lu", (unsigned long)fd);
+			remove_client(fd, "Cannot watch socket");
+			continue;
+		}
+		poller->serve_reads(fd);
+		if (client->registration & Client::REG_NICK) {
+			assign_uid(*client);
+			client->nick_ts = time(NULL);
+		}
+		client->timer.id = fd;
+		client->last_input = client->last_command = timers.now();
+		schedule_liveness(*client);
+		client->backlogged = true;
+		backlog.push_back(std::make_pair((int)fd, client->current_generation()));
+		update_interest(fd);
+	}
+}
@@ -0,0 +1,144 @@
+#include "../history.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+ChannelHistory::ChannelHistory(size_t limit)
+	: arena(new char[HISTORY_ARENA_SIZE]), head(0), used(0), count(0), limit(limit) {}
+
+ChannelHistory::~ChannelHistory() {
+	delete[] arena;
+}
+
+// Ring accessors, a record or its header may wrap past the end
+void ChannelHistory::put(size_t offset, const char *data, size_t length) {
+	size_t first = std::min(length, (size_t)HISTORY_ARENA_SIZE - offset);
+	std::memcpy(arena + offset, data, first);
+	std::memcpy(arena, data + first, length - first);
+}
+
+void ChannelHistory::get(size_t offset, char *data, size_t length) const {
+	size_t first = std::min(length, (size_t)HISTORY_ARENA_SIZE - offset);
+	std::memcpy(data, arena + offset, first);
+	std::memcpy(data + first, arena, length - first);
+}
+
+size_t ChannelHistory::record_length(size_t offset) const {
+	unsigned char header[2];
+	get(offset, reinterpret_cast<char *>(header), 2);
+	return header[0] | (header[1] << 8);
+}
+
+void ChannelHistory::drop_oldest() {
+	size_t record = 2 + record_length(head);
+	head = (head + record) % HISTORY_ARENA_SIZE;
+	used -= record;
+	count--;
+}
+
+void ChannelHistory::append(const char *data, size_t length) {
+	size_t record = 2 + length;
+	if (record > HISTORY_ARENA_SIZE || limit == 0)
+		return;
+	while (count > 0 && (count >= limit || used + record > HISTORY_ARENA_SIZE))
+		drop_oldest();
+
+	size_t tail = (head + used) % HISTORY_ARENA_SIZE;
+	char header[2] = { (char)(length & 0xff), (char)(length >> 8) };
+	put(tail, header, 2);
+	put((tail + 2) % HISTORY_ARENA_SIZE, data, length);
+	used += record;
+	count++;
+}
+
+// Appends the newest `wanted` records to out, oldest first
+size_t ChannelHistory::latest(size_t wanted, std::string &out) const {
+	size_t skip = count > wanted ? count - wanted : 0;
+	size_t offset = head;
+	for (size_t i = 0; i < count; i++) {
+		size_t length = record_length(offset);
+		if (i >= skip) {
+			size_t at = out.size();
+			out.resize(at + length);
+			get((offset + 2) % HISTORY_ARENA_SIZE, &out[at], length);
+		}
+		offset = (offset + 2 + length) % HISTORY_ARENA_SIZE;
+	}
+	return count - skip;
+}
+
+size_t ChannelHistory::size() const {
+	return count;
+}
+
+HistoryStore::HistoryStore(size_t lines, size_t memory)
+	: lines(lines), memory(memory), allocated(0) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+HistoryStore::~HistoryStore() {
+	while (!lru.empty())
+		evict_oldest();
+	pthread_mutex_destroy(&mutex);
+}
+
+void HistoryStore::touch(Entry &entry) {
+	lru.splice(lru.begin(), lru, entry.recent);
+}
+
+void HistoryStore::evict_oldest() {
+	Entry *entry = entries.find(lru.back());
+	delete entry->history;
+	entries.erase(lru.back());
+	lru.pop_back();
+	allocated -= HISTORY_ARENA_SIZE;
+}
+
+void HistoryStore::record(const std::string &channel, const char *line, size_t length) {
+	if (lines == 0 || memory < HISTORY_ARENA_SIZE)
+		return;
+	pthread_mutex_lock(&mutex);
+	Entry *entry = entries.find(channel);
+	if (entry) {
+		touch(*entry);
+	} else {
+		while (allocated + HISTORY_ARENA_SIZE > memory)
+			evict_oldest();
+		lru.push_front(channel);
+		Entry created;
+		created.history = new ChannelHistory(lines);
+		created.recent = lru.begin();
+		entries.insert(channel, created);
+		allocated += HISTORY_ARENA_SIZE;
+		entry = entries.find(channel);
+	}
+	entry->history->append(line, length);
+	pthread_mutex_unlock(&mutex);
+}
+
+// Appends up to `wanted` of the channel's latest lines to out and returns
+// how many there were
+size_t HistoryStore::replay(const std::string &channel, size_t wanted, std::string &out) {
+	pthread_mutex_lock(&mutex);
+	size_t replayed = 0;
+	Entry *entry = entries.find(channel);
+	if (entry) {
+		touch(*entry);
+		replayed = entry->history->latest(wanted, out);
+	}
+	pthread_mutex_unlock(&mutex);
+	return replayed;
+}
+
+// The channel is gone, a new one by the same name starts empty
+void HistoryStore::forget(const std::string &channel) {
+	pthread_mutex_lock(&mutex);
+	Entry *entry = entries.find(channel);
+	if (entry) {
+		delete entry->history;
+		lru.erase(entry->recent);
+		entries.erase(channel);
+		allocated -= HISTORY_ARENA_SIZE;
+	}
+	pthread_mutex_unlock(&mutex);
+}
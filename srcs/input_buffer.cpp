@@ -0,0 +1,64 @@
+#include "../input_buffer.hpp"
+
+#include <cstring>
+
+InputBuffer::InputBuffer() : start(0), end(0), scanned(0), discarding(false) {}
+
+char *InputBuffer::write_ptr() {
+	return bytes + end;
+}
+
+size_t InputBuffer::write_space() {
+	if (start > 0) {
+		std::memmove(bytes, bytes + start, end - start);
+		end -= start;
+		scanned -= start;
+		start = 0;
+	}
+	return INPUT_BUFFER_SIZE - end;
+}
+
+void InputBuffer::commit(size_t length) {
+	end += length;
+}
+
+// The view stays valid until the next write_space() call. Lines longer
+// than IRC_LINE_MAX are reported once and skipped up to their newline.
+InputBuffer::Frame InputBuffer::next_line(StringView &line) {
+	while (true) {
+		const char *newline = static_cast<const char *>(
+			std::memchr(bytes + scanned, '\n', end - scanned));
+		if (!newline) {
+			scanned = end;
+			if (end - start < IRC_LINE_MAX)
+				return NONE;
+			// No terminator within the limit, nothing here is worth keeping
+			start = end = scanned = 0;
+			if (discarding)
+				return NONE;
+			discarding = true;
+			return TOO_LONG;
+		}
+
+		size_t line_start = start;
+		size_t line_end = newline - bytes;
+		start = scanned = line_end + 1;
+		if (discarding) {
+			discarding = false;
+			continue;
+		}
+		if (line_end > line_start && bytes[line_end - 1] == '\r')
+			line_end--;
+		if (line_end - line_start > IRC_LINE_MAX - 2)
+			return TOO_LONG;
+		if (line_end == line_start)
+			continue; // Empty lines are ignored
+		line = StringView(bytes + line_start, line_end - line_start);
+		return LINE;
+	}
+}
+
+// Received bytes not yet consumed as lines
+StringView InputBuffer::pending() const {
+	return StringView(bytes + start, end - start);
+}
@@ -0,0 +1,650 @@
+#include "../ircserv.hpp"
+
+#include <sstream>
+#include <ctime>
+#include <netdb.h>
+
+// Server links. Servers form a tree over their links: a server passes
+// every change it makes or hears about to all its links but the one it
+// came from, and a second path to a known server is refused, so nothing
+// goes around twice. Users are named by uid on the wire.
+//
+//   SERVER <name> <password>            handshake, each side sends one
+//   LINKED <name> / SQUIT <name>        a server behind the sender came or went
+//   UID <uid> <nick> <ts> <user> <server>
+//   SJOIN <channel> <+it> <limit> <key|*> :[@]<uid> ...   burst, merged
+//   :<uid> NICK <nick> <ts> / QUIT / JOIN <channel> / KICK <channel> <uid>
+//   :<uid> INVITE <uid> <channel> / CHANOP <channel> <uid> <+|->
+//   :<uid> CMODE <channel> <+it> <limit> :<key>
+//   MASK <channel> <+|-><b|e|I> <mask>            also sent in bursts
+//   :<uid> TOPIC <channel> :<text> / PRIVMSG <channel|uid> :<text>
+//
+// Channel text only goes down links with members behind them.
+const IRCServer::LinkCommand IRCServer::link_table[] = {
+	{ "PRIVMSG", &IRCServer::link_privmsg, LINK_ESTABLISHED, StateLock::READ, true },
+	{ "TOPIC", &IRCServer::link_topic, LINK_ESTABLISHED, StateLock::READ, true },
+	{ "JOIN", &IRCServer::link_join, LINK_ESTABLISHED, StateLock::WRITE, true },
+	{ "NICK", &IRCServer::link_nick, LINK_ESTABLISHED, StateLock::WRITE, true },
+	{ "QUIT", &IRCServer::link_quit, LINK_ESTABLISHED, StateLock::WRITE, true },
+	{ "KICK", &IRCServer::link_kick, LINK_ESTABLISHED, StateLock::WRITE, true },
+	{ "INVITE", &IRCServer::link_invite, LINK_ESTABLISHED, StateLock::WRITE, true },
+	{ "CHANOP", &IRCServer::link_chanop, LINK_ESTABLISHED, StateLock::WRITE, true },
+	{ "CMODE", &IRCServer::link_cmode, LINK_ESTABLISHED, StateLock::WRITE, true },
+	{ "MASK", &IRCServer::link_mask, LINK_ESTABLISHED, StateLock::WRITE, false },
+	{ "UID", &IRCServer::link_uid, LINK_ESTABLISHED, StateLock::WRITE, false },
+	{ "SJOIN", &IRCServer::link_sjoin, LINK_ESTABLISHED, StateLock::WRITE, false },
+	{ "LINKED", &IRCServer::link_linked, LINK_ESTABLISHED, StateLock::WRITE, false },
+	{ "SQUIT", &IRCServer::link_squit, LINK_ESTABLISHED, StateLock::WRITE, false },
+	{ "PING", &IRCServer::link_ping, LINK_ANY, StateLock::NONE, false },
+	{ "PONG", &IRCServer::link_pong, LINK_ANY, StateLock::NONE, false },
+	{ "SERVER", &IRCServer::link_server, LINK_HANDSHAKE, StateLock::WRITE, false },
+	{ "ERROR", &IRCServer::link_error, LINK_ANY, StateLock::NONE, false },
+};
+
+const size_t IRCServer::link_command_count = sizeof(link_table) / sizeof(link_table[0]);
+
+static std::string mode_flags(const Channel &mode) {
+	std::string flags = "+";
+	if (mode.invite_only)
+		flags += 'i';
+	if (mode.topic_restricted)
+		flags += 't';
+	return flags;
+}
+
+static bool has_flag(const StringView &flags, char flag) {
+	return std::memchr(flags.data, flag, flags.size) != NULL;
+}
+
+static std::string uid_line(const Client &user, const std::string &server) {
+	std::ostringstream line;
+	line << "UID " << user.uid << " " << user.nickname << " " << user.nick_ts << " "
+		<< (user.username.empty() ? "*" : user.username) << " " << server << "\n";
+	return line.str();
+}
+
+// Worker 0 keeps a connection to every --link peer, lost ones are
+// retried every LINK_RETRY_INTERVAL
+void IRCServer::connect_links() {
+	for (size_t i = 0; i < outbound.size(); i++) {
+		Client *link = find_client(outbound[i].first);
+		if (link && link->kind == Client::LINK && link->current_generation() == outbound[i].second)
+			continue;
+		outbound[i].first = -1;
+
+		const std::string &target = config.links[i];
+		size_t colon = target.rfind(':');
+		struct addrinfo hints;
+		struct addrinfo *found;
+		std::memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(target.substr(0, colon).c_str(), target.c_str() + colon + 1, &hints, &found) != 0) {
+			log_write(LOG_ERROR, "link_unresolved target=%s", target.c_str());
+			continue;
+		}
+		struct sockaddr_in peer;
+		std::memcpy(&peer, found->ai_addr, sizeof(peer));
+		freeaddrinfo(found);
+
+		int link_socket = socket(AF_INET, SOCK_STREAM, 0);
+		if (link_socket < 0)
+			continue;
+		set_non_blocking(link_socket);
+		if ((size_t)link_socket >= state.remote_base
+			|| (connect(link_socket, (struct sockaddr *)&peer, sizeof(peer)) < 0 && errno != EINPROGRESS)) {
+			close(link_socket);
+			continue;
+		}
+
+		__atomic_add_fetch(&state.connections, 1, __ATOMIC_RELAXED);
+		if (!clients[link_socket])
+			clients[link_socket] = new Client();
+		Client &client = *clients[link_socket];
+		client.open(link_socket, peer, worker_id);
+		client.kind = Client::LINK;
+		// The registration deadline bounds the connect and the handshake
+		client.timer.id = link_socket;
+		client.last_input = client.last_command = timers.now();
+		schedule_liveness(client);
+		stat_add(stats.accepted, 1);
+		if (!poller->add(link_socket, POLLIN)) {
+			client.reset();
+			close(link_socket);
+			__atomic_sub_fetch(&state.connections, 1, __ATOMIC_RELAXED);
+			stat_add(stats.disconnected, 1);
+			continue;
+		}
+		outbound[i] = std::make_pair(link_socket, client.current_generation());
+		// Queued until the connection is up, POLLOUT flushes it. This runs
+		// before the poll, past the turn's corked flush, so ask for POLLOUT now.
+		send_to_client(link_socket, "SERVER " + config.server_name + " " + config.link_password + "\n");
+		update_interest(link_socket);
+		log_write(LOG_INFO, "link_connecting fd=%d target=%s", link_socket, target.c_str());
+	}
+}
+
+// Milliseconds to the next reconnect round, -1 without --link
+int IRCServer::link_timeout() {
+	if (outbound.empty())
+		return -1;
+	unsigned long long now = monotonic_ns();
+	if (now >= next_link_attempt) {
+		connect_links();
+		next_link_attempt = now + LINK_RETRY_INTERVAL * 1000000000ULL;
+	}
+	return (next_link_attempt - now) / 1000000 + 1;
+}
+
+// SERVER <name> <password> from a peer connecting to the client port
+void IRCServer::cmd_server(int client_socket, const IrcMessage &msg) {
+	Client &client = *clients[client_socket];
+	if (client.registration) {
+		send_to_client(client_socket, "You may not reregister\n");
+		return;
+	}
+	if (!valid_peer(client_socket, msg.param(0).str(), msg.param(1).str()))
+		return;
+	client.kind = Client::LINK;
+	send_to_client(client_socket, "SERVER " + config.server_name + " " + config.link_password + "\n");
+	establish_link(client_socket, msg.param(0).str());
+}
+
+// The answer to the SERVER line connect_links sent
+void IRCServer::link_server(int link_socket, int source, const IrcMessage &msg) {
+	(void)source;
+	if (valid_peer(link_socket, msg.param(0).str(), msg.param(1).str()))
+		establish_link(link_socket, msg.param(0).str());
+}
+
+// A server already on the network would close a cycle, refuse it
+bool IRCServer::valid_peer(int link_socket, const std::string &name, const std::string &link_password) {
+	const char *error = NULL;
+	if (config.link_password.empty() || link_password != config.link_password)
+		error = "Bad link password";
+	else if (name.empty() || name == config.server_name || state.servers.count(name))
+		error = "Server already linked";
+	if (!error)
+		return true;
+	log_write(LOG_WARN, "link_refused fd=%d server=%s reason=\"%s\"", link_socket, name.c_str(), error);
+	send_to_client(link_socket, std::string("ERROR :") + error + "\n");
+	schedule_close(link_socket, error);
+	return false;
+}
+
+void IRCServer::establish_link(int link_socket, const std::string &name) {
+	Client &link = *clients[link_socket];
+	link.server = name;
+	link.liveness = Client::ALIVE;
+	schedule_liveness(link);
+	send_to_links("LINKED " + name + "\n", -1);
+	state.servers[name] = link_socket;
+	state.links.push_back(link_socket);
+	send_burst(link_socket);
+	log_write(LOG_INFO, "link_up fd=%d server=%s", link_socket, name.c_str());
+}
+
+// Everything the new peer lacks: the servers, users and channels on
+// this side of the link. Queued whole past the sendq, it is sent once.
+void IRCServer::send_burst(int link_socket) {
+	std::string burst;
+	for (std::map<std::string, int>::iterator it = state.servers.begin(); it != state.servers.end(); ++it) {
+		if (it->second != link_socket)
+			burst += "LINKED " + it->first + "\n";
+	}
+
+	for (size_t id = 0; id < clients.size(); id++) {
+		Client *user = clients[id];
+		if (!user || user->state == Client::FREE)
+			continue;
+		if (user->kind == Client::LOCAL && user->authenticated())
+			burst += uid_line(*user, config.server_name);
+		else if (user->kind == Client::REMOTE && user->link != link_socket)
+			burst += uid_line(*user, user->server);
+	}
+
+	for (ChannelDirectory::iterator chan = state.directory.begin(); chan != state.directory.end(); ++chan) {
+		Channel &mode = *chan->second;
+		std::ostringstream head;
+		head << "SJOIN " << mode.name << " " << mode_flags(mode) << " " << mode.user_limit << " "
+			<< (mode.key.empty() ? "*" : mode.key) << " :";
+		std::string line = head.str();
+		size_t fixed = line.size();
+		bool sent = false;
+		for (std::vector<int>::const_iterator it = mode.members.begin(); it != mode.members.end(); ++it) {
+			const Client &member = *clients[*it];
+			if (member.kind == Client::REMOTE ? member.link == link_socket : !member.authenticated())
+				continue;
+			std::string entry = (mode.is_operator(*it) ? "@" : "") + member.uid;
+			// Long member lists take several lines, the peer merges them all
+			if (line.size() > fixed && line.size() + entry.size() + 3 > IRC_LINE_MAX) {
+				burst += line + "\n";
+				line.resize(fixed);
+			}
+			if (line.size() > fixed)
+				line += ' ';
+			line += entry;
+			sent = true;
+		}
+		if (!sent)
+			continue;
+		burst += line + "\n";
+		for (const char *letter = "beI"; *letter; letter++) {
+			const MaskList &list = *mode.masks(*letter);
+			for (size_t i = 0; i < list.size(); i++)
+				burst += "MASK " + mode.name + " +" + *letter + " " + list.mask(i) + "\n";
+		}
+	}
+
+	Client *link = find_client(link_socket);
+	if (!link || burst.empty())
+		return;
+	link->output.chunks.push_back(BufferRef(burst));
+	link->output.bytes += burst.size();
+	flush_client(link_socket);
+}
+
+// Lines from a linked server. There is no flood control, a peer relays
+// a whole network's traffic and is trusted once it knows the password.
+void IRCServer::process_link_line(int link_socket, const StringView &line) {
+	IrcMessage msg;
+	if (!msg.parse(line))
+		return;
+	Client &link = *clients[link_socket];
+	link.last_command = timers.now();
+
+	const LinkCommand *command = NULL;
+	for (size_t i = 0; i < link_command_count && !command; i++) {
+		if (msg.command.size == std::strlen(link_table[i].name)
+			&& std::memcmp(msg.command.data, link_table[i].name, msg.command.size) == 0)
+			command = &link_table[i];
+	}
+	// Unknown verbs are skipped, a newer peer may send more
+	bool established = !link.server.empty();
+	if (!command || command->phase == (established ? LINK_HANDSHAKE : LINK_ESTABLISHED))
+		return;
+
+	StateLock guard(state, command->lock);
+	int source = -1;
+	if (command->sourced) {
+		source = find_user(msg.prefix);
+		// Only users behind this link may speak through it
+		if (source == -1 || clients[source]->kind != Client::REMOTE || clients[source]->link != link_socket)
+			return;
+	}
+	link_line = line;
+	(this->*command->handler)(link_socket, source, msg);
+}
+
+void IRCServer::send_to_links(const BufferRef &line, int except_link) {
+	for (size_t i = 0; i < state.links.size(); i++) {
+		if (state.links[i] != except_link)
+			send_to_client(state.links[i], line);
+	}
+}
+
+void IRCServer::send_to_links(const std::string &line, int except_link) {
+	if (!state.links.empty())
+		send_to_links(BufferRef(line), except_link);
+}
+
+// Remote members sort after local ones, so only they are visited
+void IRCServer::relay_to_channel(Channel &channel, const BufferRef &line, int except_link) {
+	if (state.links.empty())
+		return;
+	for (std::vector<int>::iterator it = std::lower_bound(channel.members.begin(), channel.members.end(),
+			(int)state.remote_base); it != channel.members.end(); ++it) {
+		int link = clients[*it]->link;
+		if (link != except_link && std::find(relayed.begin(), relayed.end(), link) == relayed.end()) {
+			relayed.push_back(link);
+			send_to_client(link, line);
+		}
+	}
+	relayed.clear();
+}
+
+// Passes the line being handled on to the rest of the tree
+void IRCServer::forward_line(int except_link) {
+	if (state.links.size() > 1)
+		send_to_links((MessageBuilder() << link_line << "\n").build(), except_link);
+}
+
+// A link went down: every server and user behind it is gone
+void IRCServer::unlink_servers(int link_socket) {
+	state.links.erase(std::remove(state.links.begin(), state.links.end(), link_socket), state.links.end());
+	for (size_t id = state.remote_base; id < clients.size(); id++) {
+		if (clients[id] && clients[id]->state != Client::FREE && clients[id]->link == link_socket)
+			remove_remote_user(id);
+	}
+	for (std::map<std::string, int>::iterator it = state.servers.begin(); it != state.servers.end();) {
+		if (it->second == link_socket) {
+			send_to_links("SQUIT " + it->first + "\n", link_socket);
+			state.servers.erase(it++);
+		} else
+			++it;
+	}
+	if (!clients[link_socket]->server.empty())
+		log_write(LOG_WARN, "link_down fd=%d server=%s", link_socket, clients[link_socket]->server.c_str());
+}
+
+void IRCServer::drop_server(const std::string &name) {
+	for (size_t id = state.remote_base; id < clients.size(); id++) {
+		if (clients[id] && clients[id]->state != Client::FREE && clients[id]->server == name)
+			remove_remote_user(id);
+	}
+	state.servers.erase(name);
+}
+
+// Local users get their uid with their first nickname
+void IRCServer::assign_uid(Client &client) {
+	if (!client.uid.empty())
+		return;
+	std::ostringstream uid;
+	uid << ++state.next_uid << "." << config.server_name;
+	client.uid = uid.str();
+	state.uids.insert(client.uid, client.socket);
+}
+
+// Tells the network about a user once it has authenticated
+void IRCServer::introduce_user(int client_socket) {
+	send_to_links(uid_line(*clients[client_socket], config.server_name), -1);
+}
+
+int IRCServer::find_user(const StringView &uid) {
+	int *user = state.uids.find(uid.data, uid.size);
+	return user ? *user : -1;
+}
+
+// UID <uid> <nick> <ts> <user> <server>, returns the new slot or -1
+int IRCServer::add_remote_user(int link_socket, const IrcMessage &msg) {
+	std::map<std::string, int>::iterator via = state.servers.find(msg.param(4).str());
+	if (msg.param_count < 5 || via == state.servers.end() || via->second != link_socket
+		|| find_user(msg.param(0)) != -1)
+		return -1;
+	if (state.remote_free.empty()) {
+		log_write(LOG_ERROR, "remote_user_dropped uid=%s reason=\"too many remote users\"", msg.param(0).str().c_str());
+		return -1;
+	}
+	int user = state.remote_free.back();
+	state.remote_free.pop_back();
+	if (!clients[user])
+		clients[user] = new Client();
+
+	Client &client = *clients[user];
+	struct sockaddr_in nowhere;
+	std::memset(&nowhere, 0, sizeof(nowhere));
+	client.open(user, nowhere, worker_id);
+	client.kind = Client::REMOTE;
+	client.registration = Client::REG_NICK | Client::REG_PASS | Client::REG_USER;
+	client.uid = msg.param(0).str();
+	client.server = via->first;
+	client.link = link_socket;
+	if (msg.param(3).str() != "*")
+		client.username = msg.param(3).str();
+	state.uids.insert(client.uid, user);
+	claim_nickname(user, msg.param(1).str(), std::strtoull(msg.param(2).str().c_str(), NULL, 10));
+	return user;
+}
+
+void IRCServer::remove_remote_user(int user) {
+	Client &client = *clients[user];
+	nicknames.release(client.nickname);
+	leave_all_channels(user);
+	state.uids.erase(client.uid);
+	client.reset();
+	state.remote_free.push_back(user);
+}
+
+// Two users want one nickname: whoever has held it longest keeps it,
+// ties go to the smaller uid, and the loser falls back to its uid. Every
+// server reaches the same verdict on its own, so nothing is sent.
+void IRCServer::claim_nickname(int user, const std::string &nickname, unsigned long long nick_ts) {
+	Client &client = *clients[user];
+	std::string wanted = nickname;
+	int holder = nicknames.find(nickname);
+	if (holder != -1 && holder != user) {
+		const Client &other = *clients[holder];
+		if (nick_ts < other.nick_ts || (nick_ts == other.nick_ts && client.uid < other.uid))
+			rename_to_uid(holder);
+		else
+			wanted = client.uid;
+	}
+	nicknames.claim(user, client.nickname, wanted);
+	client.nickname = wanted;
+	client.update_hostmask();
+	client.nick_ts = nick_ts;
+}
+
+void IRCServer::rename_to_uid(int user) {
+	Client &client = *clients[user];
+	log_write(LOG_INFO, "nick_collision nick=%s uid=%s", client.nickname.c_str(), client.uid.c_str());
+	nicknames.claim(user, client.nickname, client.uid);
+	client.nickname = client.uid;
+	client.update_hostmask();
+	send_to_client(user, "Nickname collision, you are now known as " + client.uid + "\n");
+}
+
+std::string IRCServer::mode_line(const Channel &mode, int source) {
+	std::ostringstream line;
+	line << ":" << clients[source]->uid << " CMODE " << mode.name << " " << mode_flags(mode) << " "
+		<< mode.user_limit << " :" << mode.key << "\n";
+	return line.str();
+}
+
+void IRCServer::link_error(int link_socket, int source, const IrcMessage &msg) {
+	(void)source;
+	log_write(LOG_ERROR, "link_error fd=%d message=\"%s\"", link_socket, msg.param(0).str().c_str());
+	schedule_close(link_socket, "Link error");
+}
+
+void IRCServer::link_ping(int link_socket, int source, const IrcMessage &msg) {
+	(void)source;
+	send_to_client(link_socket, "PONG :" + msg.param(0).str() + "\n");
+}
+
+void IRCServer::link_pong(int link_socket, int source, const IrcMessage &msg) {
+	(void)link_socket;
+	(void)source;
+	(void)msg;
+}
+
+void IRCServer::link_linked(int link_socket, int source, const IrcMessage &msg) {
+	(void)source;
+	std::string name = msg.param(0).str();
+	if (name.empty())
+		return;
+	if (name == config.server_name || state.servers.count(name)) {
+		log_write(LOG_WARN, "link_cycle fd=%d server=%s", link_socket, name.c_str());
+		send_to_client(link_socket, "ERROR :Server " + name + " already linked\n");
+		schedule_close(link_socket, "Link cycle");
+		return;
+	}
+	state.servers[name] = link_socket;
+	forward_line(link_socket);
+}
+
+void IRCServer::link_squit(int link_socket, int source, const IrcMessage &msg) {
+	(void)source;
+	std::string name = msg.param(0).str();
+	std::map<std::string, int>::iterator it = state.servers.find(name);
+	if (it == state.servers.end() || it->second != link_socket || name == clients[link_socket]->server)
+		return;
+	drop_server(name);
+	forward_line(link_socket);
+}
+
+void IRCServer::link_uid(int link_socket, int source, const IrcMessage &msg) {
+	(void)source;
+	if (add_remote_user(link_socket, msg) != -1)
+		forward_line(link_socket);
+}
+
+void IRCServer::link_nick(int link_socket, int source, const IrcMessage &msg) {
+	if (msg.param(0).empty())
+		return;
+	claim_nickname(source, msg.param(0).str(), std::strtoull(msg.param(1).str().c_str(), NULL, 10));
+	forward_line(link_socket);
+}
+
+void IRCServer::link_quit(int link_socket, int source, const IrcMessage &msg) {
+	(void)msg;
+	remove_remote_user(source);
+	forward_line(link_socket);
+}
+
+void IRCServer::link_join(int link_socket, int source, const IrcMessage &msg) {
+	std::string channel = msg.param(0).str();
+	if (channel.empty() || channel[0] != '#')
+		return;
+	Channel *chan = state.find_channel(channel);
+	if (!chan)
+		chan = state.create_channel(channel);
+	if (!chan->has_member(source)) {
+		add_member(*chan, source);
+		send_to_channel(*chan, clients[source]->nickname + " has joined the channel\n", source);
+	}
+	forward_line(link_socket);
+}
+
+void IRCServer::link_kick(int link_socket, int source, const IrcMessage &msg) {
+	std::string channel = msg.param(0).str();
+	int target = find_user(msg.param(1));
+	Channel *chan = state.find_channel(channel);
+	if (target != -1 && chan && chan->has_member(target)) {
+		remove_member(*chan, target);
+		send_to_channel(*chan, clients[target]->nickname + " has been kicked by " + clients[source]->nickname + "\n", source);
+		send_to_client(target, "You have been kicked from channel " + channel + "\n");
+		reclaim_channel(*chan);
+	}
+	forward_line(link_socket);
+}
+
+void IRCServer::link_invite(int link_socket, int source, const IrcMessage &msg) {
+	int target = find_user(msg.param(0));
+	std::string channel = msg.param(1).str();
+	Channel *chan = state.find_channel(channel);
+	if (target != -1 && chan) {
+		add_member(*chan, target);
+		send_to_client(target, "You have been invited to channel " + channel + " by " + clients[source]->nickname + "\n");
+		send_to_channel(*chan, clients[target]->nickname + " has been invited to the channel by " + clients[source]->nickname + "\n", source);
+	}
+	forward_line(link_socket);
+}
+
+void IRCServer::link_chanop(int link_socket, int source, const IrcMessage &msg) {
+	std::string channel = msg.param(0).str();
+	int target = find_user(msg.param(1));
+	Channel *chan = state.find_channel(channel);
+	if (target != -1 && chan) {
+		bool adding = msg.param(2).str() == "+";
+		set_operator(*chan, target, adding);
+		if (target != source)
+			send_to_client(target, clients[source]->nickname + (adding ? " added you as an operator of channel: "
+				: " remove you from the operators of channel: ") + channel + "\n");
+	}
+	forward_line(link_socket);
+}
+
+// The sender's full mode state replaces ours
+void IRCServer::link_cmode(int link_socket, int source, const IrcMessage &msg) {
+	(void)source;
+	Channel *chan = state.find_channel(msg.param(0).str());
+	if (chan) {
+		Channel &mode = *chan;
+		mode.invite_only = has_flag(msg.param(1), 'i');
+		mode.topic_restricted = has_flag(msg.param(1), 't');
+		mode.user_limit = std::atoi(msg.param(2).str().c_str());
+		mode.key = msg.param(3).str();
+	}
+	forward_line(link_socket);
+}
+
+// Lists merge like members do, a mask set on either side stays
+void IRCServer::link_mask(int link_socket, int source, const IrcMessage &msg) {
+	(void)source;
+	Channel *chan = state.find_channel(msg.param(0).str());
+	StringView change = msg.param(1);
+	MaskList *list = (chan && change.size == 2) ? chan->masks(change.data[1]) : NULL;
+	if (list && !msg.param(2).empty()) {
+		std::string mask = MaskList::normalize(msg.param(2).str());
+		if (change.data[0] == '+')
+			list->add(mask);
+		else
+			list->remove(mask);
+	}
+	forward_line(link_socket);
+}
+
+// A netjoin: both sides end up with the union of members and operators,
+// the stricter limit and the smaller key, whatever order bursts arrive in
+void IRCServer::link_sjoin(int link_socket, int source, const IrcMessage &msg) {
+	(void)source;
+	std::string channel = msg.param(0).str();
+	if (channel.empty() || channel[0] != '#')
+		return;
+	Channel *chan = state.find_channel(channel);
+	if (!chan)
+		chan = state.create_channel(channel);
+	Channel &mode = *chan;
+	mode.invite_only = mode.invite_only || has_flag(msg.param(1), 'i');
+	mode.topic_restricted = mode.topic_restricted || has_flag(msg.param(1), 't');
+	int limit = std::atoi(msg.param(2).str().c_str());
+	if (limit > 0 && (mode.user_limit == 0 || limit < mode.user_limit))
+		mode.user_limit = limit;
+	std::string key = msg.param(3).str();
+	if (key != "*" && (mode.key.empty() || key < mode.key))
+		mode.key = key;
+
+	StringView members = msg.param(4);
+	const char *p = members.data;
+	const char *end = members.data + members.size;
+	while (p < end) {
+		const char *start = p;
+		while (p < end && *p != ' ')
+			p++;
+		bool op = start < p && *start == '@';
+		int user = find_user(StringView(start + op, p - start - op));
+		if (user != -1) {
+			add_member(mode, user);
+			if (op)
+				set_operator(mode, user, true);
+		}
+		while (p < end && *p == ' ')
+			p++;
+	}
+	// Every member named was unknown here
+	reclaim_channel(mode);
+	forward_line(link_socket);
+}
+
+void IRCServer::link_topic(int link_socket, int source, const IrcMessage &msg) {
+	std::string channel = msg.param(0).str();
+	Channel *chan = state.find_channel(channel);
+	if (!chan)
+		return;
+	chan->topic = msg.param(1).str();
+	send_to_channel(*chan, "Topic for channel " + channel + " set to: " + chan->topic + "\n", source);
+	relay_to_channel(*chan, (MessageBuilder() << link_line << "\n").build(), link_socket);
+}
+
+// Rendered here for local members, passed on as is to links with members
+void IRCServer::link_privmsg(int link_socket, int source, const IrcMessage &msg) {
+	std::string target = msg.param(0).str();
+	if (!target.empty() && target[0] == '#') {
+		Channel *chan = state.find_channel(target);
+		if (!chan)
+			return;
+		BufferRef line = (MessageBuilder() << clients[source]->nickname << ": " << msg.param(1) << "\n").build();
+		send_to_channel(*chan, line, source);
+		state.history.record(target, line.data(), line.size());
+		relay_to_channel(*chan, (MessageBuilder() << link_line << "\n").build(), link_socket);
+		return;
+	}
+	int user = find_user(msg.param(0));
+	if (user == -1)
+		return;
+	if ((size_t)user < state.remote_base)
+		send_to_client(user, (MessageBuilder() << clients[source]->nickname << " (private): " << msg.param(1) << "\n").build());
+	else if (clients[user]->link != link_socket)
+		send_to_client(clients[user]->link, (MessageBuilder() << link_line << "\n").build());
+}
@@ -0,0 +1,242 @@
+#include "../ircserv.hpp"
+
+#include <sstream>
+
+Listing::Listing(Kind kind, const std::string &mask)
+	: kind(kind), mask(mask), prefix(mask.substr(0, mask.find_first_of("*?"))),
+	  min_members(0), max_members(0), resume_member(-1) {}
+
+// Backtracks to the last '*' only, so it stays linear in practice
+bool glob_match(const char *pattern, size_t pattern_size, const char *text, size_t text_size) {
+	size_t p = 0, t = 0;
+	size_t star = pattern_size, retry = 0;
+	while (t < text_size) {
+		if (p < pattern_size && (pattern[p] == '?' || pattern[p] == text[t])) {
+			p++;
+			t++;
+		} else if (p < pattern_size && pattern[p] == '*') {
+			star = p++;
+			retry = t;
+		} else if (star != pattern_size) {
+			p = star + 1;
+			t = ++retry;
+		} else {
+			return false;
+		}
+	}
+	while (p < pattern_size && pattern[p] == '*')
+		p++;
+	return p == pattern_size;
+}
+
+bool glob_match(const std::string &pattern, const std::string &text) {
+	return glob_match(pattern.data(), pattern.size(), text.data(), text.size());
+}
+
+static bool has_prefix(const std::string &name, const std::string &prefix) {
+	return name.compare(0, prefix.size(), prefix) == 0;
+}
+
+// LIST [<mask>] [>N] [<N] [<topic mask>]
+void IRCServer::cmd_list(int client_socket, const IrcMessage &msg) {
+	std::string mask = "*";
+	size_t min_members = 0, max_members = 0;
+	std::string topic_mask;
+	for (size_t i = 0; i < msg.param_count; i++) {
+		std::string argument = msg.param(i).str();
+		if (argument.size() > 1 && argument[0] == '>')
+			min_members = std::strtoul(argument.c_str() + 1, NULL, 10);
+		else if (argument.size() > 1 && argument[0] == '<')
+			max_members = std::strtoul(argument.c_str() + 1, NULL, 10);
+		else if (i == 0)
+			mask = argument;
+		else
+			topic_mask = argument;
+	}
+	Listing *listing = new Listing(Listing::LIST, mask);
+	listing->min_members = min_members;
+	listing->max_members = max_members;
+	listing->topic_mask = topic_mask;
+	start_listing(client_socket, listing);
+}
+
+// NAMES [<mask>]
+void IRCServer::cmd_names(int client_socket, const IrcMessage &msg) {
+	start_listing(client_socket, new Listing(Listing::NAMES, msg.param_count > 0 ? msg.param(0).str() : "*"));
+}
+
+// WHO <#channel mask|nickname mask>
+void IRCServer::cmd_who(int client_socket, const IrcMessage &msg) {
+	std::string mask = msg.param(0).str();
+	if (mask.empty()) {
+		send_to_client(client_socket, "Usage: WHO <#channel|nickname>\n");
+		return;
+	}
+	if (mask[0] == '#')
+		start_listing(client_socket, new Listing(Listing::WHO, mask));
+	else
+		start_listing(client_socket, new Listing(Listing::WHO_USERS, NickRegistry::fold(mask)));
+}
+
+// A new listing replaces one still running
+void IRCServer::start_listing(int client_socket, Listing *listing) {
+	Client &client = *clients[client_socket];
+	bool queued = client.listing != NULL;
+	delete client.listing;
+	client.listing = listing;
+	size_t room = listing_room(client);
+	if ((room == 0 || !run_listing(client_socket, room)) && !queued)
+		listings.push_back(std::make_pair(client_socket, client.current_generation()));
+}
+
+// Room left before the client's send queue is half full, 0 when the
+// listing has to wait for it to drain
+size_t IRCServer::listing_room(const Client &client) const {
+	size_t limit = config.sendq / 2;
+	if (client.output.throttled || client.output.bytes >= limit)
+		return 0;
+	return limit - client.output.bytes;
+}
+
+// Runs after the turn's events, under one read lock for every listing
+void IRCServer::continue_listings() {
+	if (listings.empty())
+		return;
+	StateLock guard(state, StateLock::READ);
+	size_t kept = 0;
+	for (size_t i = 0; i < listings.size(); i++) {
+		Client *client = find_client(listings[i].first);
+		// Gone, replaced by a newer connection, or already answered
+		if (!client || client->current_generation() != listings[i].second || !client->listing)
+			continue;
+		if (client->state != Client::ACTIVE) {
+			delete client->listing;
+			client->listing = NULL;
+			continue;
+		}
+		size_t room = listing_room(*client);
+		if (room == 0 || !run_listing(listings[i].first, room))
+			listings[kept++] = listings[i];
+	}
+	listings.resize(kept);
+}
+
+// 0 while a listing can go on right away
+int IRCServer::listing_timeout() {
+	for (size_t i = 0; i < listings.size(); i++) {
+		Client *client = find_client(listings[i].first);
+		if (client && client->listing && listing_room(*client) > 0)
+			return 0;
+	}
+	return -1;
+}
+
+// Sends the next batch, at most `room` bytes give or take a line.
+// Returns true and drops the listing once it is complete.
+bool IRCServer::run_listing(int client_socket, size_t room) {
+	Client &client = *clients[client_socket];
+	Listing &listing = *client.listing;
+	std::string out;
+	size_t budget = LISTING_BATCH;
+	bool done = (listing.kind == Listing::WHO_USERS)
+		? list_users(listing, out, budget, room) : list_channels(listing, out, budget, room);
+	if (done) {
+		static const char *const endings[] = { "End of LIST\n", "End of NAMES\n", "End of WHO\n", "End of WHO\n" };
+		out += endings[listing.kind];
+		delete client.listing;
+		client.listing = NULL;
+	}
+	send_to_client(client_socket, out);
+	return done;
+}
+
+// "<channel> <nick> <username> <server>", with " @" for channel operators
+void IRCServer::who_line(std::string &out, const std::string &channel, int user, bool op) {
+	const Client &member = *clients[user];
+	out += channel + " " + member.nickname + " " + (member.username.empty() ? "*" : member.username) + " "
+		+ (member.kind == Client::REMOTE ? member.server : config.server_name) + (op ? " @\n" : "\n");
+}
+
+bool IRCServer::list_channels(Listing &listing, std::string &out, size_t &budget, size_t room) {
+	const ChannelDirectory &directory = state.directory;
+	ChannelDirectory::const_iterator it;
+	if (listing.resume.empty())
+		it = directory.lower_bound(StringView(listing.prefix));
+	else if (listing.resume_member != -1)
+		it = directory.lower_bound(StringView(listing.resume)); // Partway through its members
+	else
+		it = directory.upper_bound(StringView(listing.resume));
+
+	size_t scanned = 0;
+	for (; it != directory.end() && has_prefix(it->second->name, listing.prefix); ++it) {
+		if (budget == 0 || out.size() >= room || scanned++ == LISTING_SCAN)
+			return false;
+		const Channel &channel = *it->second;
+		if (!glob_match(listing.mask, channel.name)) {
+			listing.resume = channel.name;
+			continue;
+		}
+
+		if (listing.kind == Listing::LIST) {
+			size_t count = channel.members.size();
+			if (count > listing.min_members && (listing.max_members == 0 || count < listing.max_members)
+				&& (listing.topic_mask.empty() || glob_match(listing.topic_mask, channel.topic))) {
+				std::ostringstream line;
+				line << channel.name << " " << count << " :" << channel.topic << "\n";
+				out += line.str();
+				budget--;
+			}
+			listing.resume = channel.name;
+			continue;
+		}
+
+		std::vector<int>::const_iterator member = channel.members.begin();
+		if (listing.resume_member != -1 && listing.resume == channel.name)
+			member = std::upper_bound(channel.members.begin(), channel.members.end(), listing.resume_member);
+		listing.resume = channel.name;
+		listing.resume_member = -1;
+		std::string names;
+		for (; member != channel.members.end(); ++member) {
+			// Out of budget partway, the next batch picks up at this member
+			if (budget == 0 || out.size() + names.size() >= room) {
+				if (!names.empty())
+					out += "Names for " + channel.name + ":" + names + "\n";
+				listing.resume_member = *(member - 1);
+				return false;
+			}
+			budget--;
+			bool op = channel.is_operator(*member);
+			if (listing.kind == Listing::WHO) {
+				who_line(out, channel.name, *member, op);
+				continue;
+			}
+			if (names.size() + channel.name.size() + clients[*member]->nickname.size() + 16 > IRC_LINE_MAX) {
+				out += "Names for " + channel.name + ":" + names + "\n";
+				names.clear();
+			}
+			names += (op ? " @" : " ") + clients[*member]->nickname;
+		}
+		if (!names.empty())
+			out += "Names for " + channel.name + ":" + names + "\n";
+	}
+	return true;
+}
+
+// Nicknames are scanned folded, the mask was folded the same way
+bool IRCServer::list_users(Listing &listing, std::string &out, size_t &budget, size_t room) {
+	const NickRegistry::Directory &directory = nicknames.directory();
+	NickRegistry::Directory::const_iterator it = listing.resume.empty()
+		? directory.lower_bound(listing.prefix) : directory.upper_bound(listing.resume);
+
+	size_t scanned = 0;
+	for (; it != directory.end() && has_prefix(it->first, listing.prefix); ++it) {
+		if (budget == 0 || out.size() >= room || scanned++ == LISTING_SCAN)
+			return false;
+		listing.resume = it->first;
+		if (glob_match(listing.mask, it->first) && clients[it->second]->authenticated()) {
+			who_line(out, "*", it->second, false);
+			budget--;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,223 @@
+#include "../log.hpp"
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef CLOCK_REALTIME_COARSE
+# define LOG_CLOCK CLOCK_REALTIME_COARSE // Read from the vDSO, no system call
+#else
+# define LOG_CLOCK CLOCK_REALTIME
+#endif
+
+#define LOG_BATCH_BYTES 65536 // Drained lines gathered into one write
+
+struct LogSlot {
+	size_t sequence; // Slot protocol, see log_write
+	int level;
+	int worker;
+	struct timespec stamp;
+	size_t length;
+	char text[LOG_LINE_MAX];
+};
+
+LogLevel log_threshold = LOG_INFO;
+
+static const char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// Heap storage that no static destructor touches: exit() on a fatal
+// error runs while the writer may still be draining it
+static LogSlot *ring;
+static size_t tail;                 // Next slot to claim, shared by producers
+static size_t head;                 // Next slot to drain, writer thread only
+static unsigned long long dropped;
+static int log_fd = -1;
+static bool stopping;
+static pthread_t writer;
+static __thread int thread_worker = -1;
+
+static bool drain(std::string &batch, unsigned long long &reported);
+
+static void *run_writer(void *) {
+	std::string batch;
+	unsigned long long reported = 0;
+	while (true) {
+		bool stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+		if (!drain(batch, reported)) {
+			if (stop)
+				break;
+			struct timespec idle = { 0, LOG_IDLE_MS * 1000000L };
+			nanosleep(&idle, NULL);
+		}
+	}
+	return NULL;
+}
+
+static void flush_batch(std::string &batch) {
+	size_t written = 0;
+	while (written < batch.size()) {
+		ssize_t result = write(log_fd, batch.data() + written, batch.size() - written);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			break; // Nowhere to put it, keep draining so producers never stall
+		written += result;
+	}
+	batch.clear();
+}
+
+// Time is formatted here, off the producers' path, once per second
+static void append_stamp(std::string &batch, const struct timespec &stamp) {
+	static time_t cached_second = -1;
+	static char cached[32];
+	if (stamp.tv_sec != cached_second) {
+		struct tm parts;
+		gmtime_r(&stamp.tv_sec, &parts);
+		strftime(cached, sizeof(cached), "%Y-%m-%dT%H:%M:%S", &parts);
+		cached_second = stamp.tv_sec;
+	}
+	char millis[8];
+	snprintf(millis, sizeof(millis), ".%03ldZ ", stamp.tv_nsec / 1000000);
+	batch += cached;
+	batch += millis;
+}
+
+// Moves every published line into `batch` and writes it out. Returns
+// false when there was nothing to do.
+static bool drain(std::string &batch, unsigned long long &reported) {
+	bool any = false;
+	while (true) {
+		LogSlot &slot = ring[head & (LOG_RING_SLOTS - 1)];
+		if (__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) != head + 1)
+			break;
+		append_stamp(batch, slot.stamp);
+		batch += level_names[slot.level];
+		batch += ' ';
+		if (slot.worker >= 0) {
+			char worker[24];
+			snprintf(worker, sizeof(worker), "worker=%d ", slot.worker);
+			batch += worker;
+		}
+		batch.append(slot.text, slot.length);
+		batch += '\n';
+		__atomic_store_n(&slot.sequence, head + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+		head++;
+		any = true;
+		if (batch.size() >= LOG_BATCH_BYTES)
+			flush_batch(batch);
+	}
+
+	unsigned long long lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	if (lost != reported) {
+		struct timespec now;
+		clock_gettime(LOG_CLOCK, &now);
+		append_stamp(batch, now);
+		char line[64];
+		snprintf(line, sizeof(line), "WARN log_dropped lines=%llu\n", lost - reported);
+		batch += line;
+		reported = lost;
+		any = true;
+	}
+	if (!batch.empty())
+		flush_batch(batch);
+	return any;
+}
+
+// An empty path logs to standard output
+bool log_open(const std::string &path, LogLevel level) {
+	log_fd = path.empty() ? STDOUT_FILENO : open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (log_fd < 0)
+		return false;
+	ring = new LogSlot[LOG_RING_SLOTS];
+	for (size_t i = 0; i < LOG_RING_SLOTS; i++)
+		ring[i].sequence = i;
+	log_threshold = level;
+	stopping = false;
+	if (pthread_create(&writer, NULL, &run_writer, NULL) != 0) {
+		delete[] ring;
+		ring = NULL;
+		return false;
+	}
+	return true;
+}
+
+// Writes out what is left and stops the writer
+void log_close() {
+	if (!ring)
+		return;
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+	delete[] ring;
+	ring = NULL;
+	if (log_fd != STDOUT_FILENO)
+		close(log_fd);
+	log_fd = -1;
+}
+
+// Bounded multi-producer ring: a slot whose sequence equals the claimed
+// position is free, the producer fills it and publishes position + 1,
+// the writer hands it back as position + LOG_RING_SLOTS.
+void log_write(LogLevel level, const char *format, ...) {
+	if (level < log_threshold)
+		return;
+	va_list arguments;
+	va_start(arguments, format);
+	if (!ring) {
+		// Not running yet or any more, fall back to a plain write
+		vfprintf(stderr, format, arguments);
+		fputc('\n', stderr);
+		va_end(arguments);
+		return;
+	}
+
+	size_t position = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+	LogSlot *slot;
+	while (true) {
+		slot = &ring[position & (LOG_RING_SLOTS - 1)];
+		long difference = (long)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+		if (difference == 0) {
+			if (__atomic_compare_exchange_n(&tail, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (difference < 0) {
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			va_end(arguments);
+			return;
+		} else
+			position = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+	}
+
+	clock_gettime(LOG_CLOCK, &slot->stamp);
+	slot->level = level;
+	slot->worker = thread_worker;
+	int length = vsnprintf(slot->text, sizeof(slot->text), format, arguments);
+	va_end(arguments);
+	slot->length = length < 0 ? 0 : ((size_t)length < sizeof(slot->text) ? length : sizeof(slot->text) - 1);
+	__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+void log_set_worker(int worker) {
+	thread_worker = worker;
+}
+
+bool log_parse_level(const std::string &name, LogLevel &level) {
+	for (int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+		std::string lower = level_names[i];
+		for (size_t j = 0; j < lower.size(); j++)
+			lower[j] = std::tolower(lower[j]);
+		if (name == lower) {
+			level = (LogLevel)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+unsigned long long log_dropped() {
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,155 @@
+#include "../mask_list.hpp"
+#include "../nick_registry.hpp"
+
+#include <cstring>
+
+static bool segment_at(const std::string &text, size_t position, const std::string &segment) {
+	if (position + segment.size() > text.size())
+		return false;
+	for (size_t i = 0; i < segment.size(); i++) {
+		if (segment[i] != '?' && segment[i] != text[position + i])
+			return false;
+	}
+	return true;
+}
+
+MaskList::Mask::Mask(const std::string &text)
+	: text(text), prefix(text.substr(0, text.find_first_of("*?"))),
+	  anchored_front(text[0] != '*'), anchored_back(text[text.size() - 1] != '*') {
+	size_t start = 0;
+	while (start < text.size()) {
+		size_t star = text.find('*', start);
+		if (star == std::string::npos)
+			star = text.size();
+		if (star > start)
+			segments.push_back(text.substr(start, star - start));
+		start = star + 1;
+	}
+}
+
+// The front and back segments are pinned to the ends, the ones between
+// are taken at their leftmost fit, which is enough for '*' globs
+bool MaskList::Mask::matches(const std::string &hostmask) const {
+	if (hostmask.compare(0, prefix.size(), prefix) != 0)
+		return false;
+	size_t first = 0, last = segments.size();
+	size_t begin = 0, end = hostmask.size();
+	if (anchored_front && anchored_back && last == 1)
+		return hostmask.size() == segments[0].size() && segment_at(hostmask, 0, segments[0]);
+	if (anchored_front) {
+		if (!segment_at(hostmask, 0, segments[first]))
+			return false;
+		begin = segments[first++].size();
+	}
+	if (anchored_back) {
+		const std::string &back = segments[--last];
+		if (back.size() > end - begin || !segment_at(hostmask, end - back.size(), back))
+			return false;
+		end -= back.size();
+	}
+	for (size_t i = first; i < last; i++) {
+		while (begin + segments[i].size() <= end && !segment_at(hostmask, begin, segments[i]))
+			begin++;
+		if (begin + segments[i].size() > end)
+			return false;
+		begin += segments[i].size();
+	}
+	return true;
+}
+
+MaskList::MaskList() {}
+
+// "nick", "user@host" and "nick!user" are filled in to nick!user@host,
+// missing parts match anything
+std::string MaskList::normalize(const std::string &mask) {
+	std::string folded = NickRegistry::fold(mask);
+	size_t bang = folded.find('!');
+	size_t at = folded.find('@', bang == std::string::npos ? 0 : bang);
+	std::string nick, user, host;
+	if (bang == std::string::npos && at == std::string::npos) {
+		nick = folded;
+	} else if (bang == std::string::npos) {
+		user = folded.substr(0, at);
+		host = folded.substr(at + 1);
+	} else {
+		nick = folded.substr(0, bang);
+		user = folded.substr(bang + 1, at == std::string::npos ? std::string::npos : at - bang - 1);
+		if (at != std::string::npos)
+			host = folded.substr(at + 1);
+	}
+	return (nick.empty() ? "*" : nick) + "!" + (user.empty() ? "*" : user) + "@" + (host.empty() ? "*" : host);
+}
+
+// Lists change rarely, against a check on every JOIN and message
+void MaskList::reindex() {
+	by_host.clear();
+	wild.clear();
+	for (size_t i = 0; i < masks.size(); i++) {
+		std::string host = masks[i].text.substr(masks[i].text.rfind('@') + 1);
+		if (host.find_first_of("*?") != std::string::npos) {
+			wild.push_back(i);
+			continue;
+		}
+		std::vector<size_t> *filed = by_host.find(host);
+		if (filed)
+			filed->push_back(i);
+		else
+			by_host.insert(host, std::vector<size_t>(1, i));
+	}
+}
+
+// Takes a normalized mask, fails if it is listed already or the list is full
+bool MaskList::add(const std::string &mask) {
+	if (masks.size() >= MAX_CHANNEL_MASKS)
+		return false;
+	for (size_t i = 0; i < masks.size(); i++) {
+		if (masks[i].text == mask)
+			return false;
+	}
+	masks.push_back(Mask(mask));
+	reindex();
+	return true;
+}
+
+bool MaskList::remove(const std::string &mask) {
+	for (size_t i = 0; i < masks.size(); i++) {
+		if (masks[i].text == mask) {
+			masks.erase(masks.begin() + i);
+			reindex();
+			return true;
+		}
+	}
+	return false;
+}
+
+// Takes a folded nick!user@host, see Client::hostmask
+bool MaskList::matches(const std::string &hostmask) {
+	if (masks.empty())
+		return false;
+	const char *host = std::strrchr(hostmask.c_str(), '@');
+	if (host) {
+		host++;
+		std::vector<size_t> *filed = by_host.find(host, hostmask.c_str() + hostmask.size() - host);
+		for (size_t i = 0; filed && i < filed->size(); i++) {
+			if (masks[(*filed)[i]].matches(hostmask))
+				return true;
+		}
+	}
+	for (size_t i = 0; i < wild.size(); i++) {
+		if (masks[wild[i]].matches(hostmask))
+			return true;
+	}
+	return false;
+}
+
+bool MaskList::empty() const {
+	return masks.empty();
+}
+
+size_t MaskList::size() const {
+	return masks.size();
+}
+
+const std::string &MaskList::mask(size_t index) const {
+	return masks[index].text;
+}
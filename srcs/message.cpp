@@ -0,0 +1,62 @@
+#include "../message.hpp"
+
+IrcMessage::IrcMessage() : param_count(0), end(NULL) {}
+
+// Single pass over the line, returns false when there is no command
+bool IrcMessage::parse(const StringView &line) {
+	const char *p = line.data;
+	end = line.data + line.size;
+	param_count = 0;
+	prefix = StringView();
+
+	while (p < end && *p == ' ')
+		p++;
+	if (p < end && *p == ':') {
+		const char *start = ++p;
+		while (p < end && *p != ' ')
+			p++;
+		prefix = StringView(start, p - start);
+		while (p < end && *p == ' ')
+			p++;
+	}
+
+	const char *start = p;
+	while (p < end && *p != ' ')
+		p++;
+	command = StringView(start, p - start);
+	if (command.empty())
+		return false;
+
+	while (param_count < IRC_MAX_PARAMS) {
+		while (p < end && *p == ' ')
+			p++;
+		if (p == end)
+			break;
+		// The trailing parameter, and the last one allowed, take the rest of the line
+		if (*p == ':' || param_count == IRC_MAX_PARAMS - 1) {
+			if (*p == ':')
+				p++;
+			params[param_count++] = StringView(p, end - p);
+			break;
+		}
+		start = p;
+		while (p < end && *p != ' ')
+			p++;
+		params[param_count++] = StringView(start, p - start);
+	}
+	return true;
+}
+
+StringView IrcMessage::param(size_t index) const {
+	if (index >= param_count)
+		return StringView();
+	return params[index];
+}
+
+// Everything from parameter `index` to the end of the line. Lets
+// PRIVMSG/TOPIC take free text whether or not the client sent a ':'.
+StringView IrcMessage::rest(size_t index) const {
+	if (index >= param_count)
+		return StringView();
+	return StringView(params[index].data, end - params[index].data);
+}
@@ -0,0 +1,52 @@
+#include "../nick_registry.hpp"
+
+static char fold_char(char c) {
+	if (c >= 'A' && c <= '^') // A-Z then [ \ ] ^ map to a-z and { | } ~
+		return c + ('a' - 'A');
+	return c;
+}
+
+std::string NickRegistry::fold(const char *nickname, size_t length) {
+	std::string folded(nickname, length);
+	for (size_t i = 0; i < length; i++)
+		folded[i] = fold_char(folded[i]);
+	return folded;
+}
+
+std::string NickRegistry::fold(const std::string &nickname) {
+	return fold(nickname.data(), nickname.size());
+}
+
+// Returns the socket owning the nickname, or -1
+int NickRegistry::find(const std::string &nickname) {
+	std::string folded = fold(nickname);
+	int *client_socket = sockets.find(folded);
+	return client_socket ? *client_socket : -1;
+}
+
+// Moves the socket from its old nickname to the new one. Fails if
+// another socket already holds it under any casing.
+bool NickRegistry::claim(int client_socket, const std::string &old_nickname, const std::string &nickname) {
+	std::string folded = fold(nickname);
+	int *owner = sockets.find(folded);
+	if (owner)
+		return *owner == client_socket;
+
+	if (!old_nickname.empty())
+		release(old_nickname);
+	sockets.insert(folded, client_socket);
+	ordered[folded] = client_socket;
+	return true;
+}
+
+void NickRegistry::release(const std::string &nickname) {
+	if (nickname.empty())
+		return;
+	std::string folded = fold(nickname);
+	sockets.erase(folded);
+	ordered.erase(folded);
+}
+
+const NickRegistry::Directory &NickRegistry::directory() const {
+	return ordered;
+}
@@ -0,0 +1,703 @@
+#include "../poller.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#ifdef HAVE_IO_URING
+# include <sys/mman.h>
+# include <time.h>
+#endif
+
+#define EPOLL_MAX_EVENTS 1024
+#define URING_SQ_ENTRIES 4096
+#define URING_CQ_ENTRIES 65536
+#define URING_IGNORED (~0ULL) // user_data of requests whose completion carries nothing
+#define URING_BUFFERS 512      // Provided receive buffers, a power of two
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+#define URING_DRAIN_ROUNDS 50  // Waits of 100ms for cancelled reads to finish
+
+// Unavailable backends fall back to the next best one: uring, epoll, poll
+Poller *Poller::create(const std::string &backend) {
+#ifdef HAVE_IO_URING
+	if (backend == "uring") {
+		UringPoller *uring = new UringPoller();
+		if (uring->valid())
+			return uring;
+		delete uring;
+	}
+#endif
+#ifdef __linux__
+	if (backend == "epoll" || backend == "uring") {
+		EpollPoller *epoller = new EpollPoller();
+		if (epoller->valid())
+			return epoller;
+		delete epoller;
+	}
+#endif
+	(void)backend;
+	return new PollPoller();
+}
+
+// poll(2) backend
+
+const char *PollPoller::name() const {
+	return "poll";
+}
+
+bool PollPoller::add(int fd, short events) {
+	if (fd < 0)
+		return false;
+	if ((size_t)fd >= slots.size())
+		slots.resize(fd + 1, -1);
+	if (slots[fd] != -1)
+		return modify(fd, events);
+
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	slots[fd] = fds.size();
+	fds.push_back(pfd);
+	return true;
+}
+
+bool PollPoller::modify(int fd, short events) {
+	if (fd < 0 || (size_t)fd >= slots.size() || slots[fd] == -1)
+		return false;
+	fds[slots[fd]].events = events;
+	return true;
+}
+
+void PollPoller::remove(int fd) {
+	if (fd < 0 || (size_t)fd >= slots.size() || slots[fd] == -1)
+		return;
+
+	// Swap the last entry into the hole so removal stays O(1)
+	int slot = slots[fd];
+	int last_fd = fds.back().fd;
+	fds[slot] = fds.back();
+	slots[last_fd] = slot;
+	fds.pop_back();
+	slots[fd] = -1;
+}
+
+int PollPoller::wait(std::vector<PollEvent> &ready, int timeout) {
+	ready.clear();
+	int poll_count = poll(fds.empty() ? NULL : &fds[0], fds.size(), timeout);
+	if (poll_count <= 0)
+		return poll_count;
+
+	for (size_t i = 0; i < fds.size() && (int)ready.size() < poll_count; i++) {
+		if (fds[i].revents) {
+			PollEvent event;
+			event.fd = fds[i].fd;
+			event.events = fds[i].revents;
+			ready.push_back(event);
+		}
+	}
+	return ready.size();
+}
+
+#ifdef __linux__
+
+// epoll(7) backend, level-triggered so it is a drop-in for the poll loop
+
+static uint32_t to_epoll(short events) {
+	uint32_t mask = 0;
+	if (events & POLLIN)
+		mask |= EPOLLIN;
+	if (events & POLLOUT)
+		mask |= EPOLLOUT;
+	return mask;
+}
+
+static short from_epoll(uint32_t mask) {
+	short events = 0;
+	if (mask & EPOLLIN)
+		events |= POLLIN;
+	if (mask & EPOLLOUT)
+		events |= POLLOUT;
+	if (mask & EPOLLERR)
+		events |= POLLERR;
+	if (mask & EPOLLHUP)
+		events |= POLLHUP;
+	return events;
+}
+
+EpollPoller::EpollPoller()
+	: epoll_fd(epoll_create1(EPOLL_CLOEXEC)), events(EPOLL_MAX_EVENTS) {}
+
+EpollPoller::~EpollPoller() {
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+}
+
+bool EpollPoller::valid() const {
+	return epoll_fd >= 0;
+}
+
+const char *EpollPoller::name() const {
+	return "epoll";
+}
+
+bool EpollPoller::add(int fd, short events) {
+	struct epoll_event event;
+	event.events = to_epoll(events);
+	event.data.u64 = 0;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0)
+		return true;
+	return errno == EEXIST && modify(fd, events);
+}
+
+bool EpollPoller::modify(int fd, short events) {
+	struct epoll_event event;
+	event.events = to_epoll(events);
+	event.data.u64 = 0;
+	event.data.fd = fd;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0;
+}
+
+void EpollPoller::remove(int fd) {
+	struct epoll_event event; // ignored, but required before Linux 2.6.9
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &event);
+}
+
+int EpollPoller::wait(std::vector<PollEvent> &ready, int timeout) {
+	ready.clear();
+	int count = epoll_wait(epoll_fd, &events[0], events.size(), timeout);
+	for (int i = 0; i < count; i++) {
+		PollEvent event;
+		event.fd = events[i].data.fd;
+		event.events = from_epoll(events[i].events);
+		ready.push_back(event);
+	}
+	return count;
+}
+
+#endif
+
+#ifdef HAVE_IO_URING
+
+// io_uring backend, no liburing: the rings are mapped by hand
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+// user_data: the operation, the fd's tag or serial, and the fd
+enum UringOp { URING_POLL, URING_READ, URING_SEND };
+
+static unsigned long long uring_data(UringOp op, unsigned tag, int fd) {
+	return ((unsigned long long)op << 56) | ((unsigned long long)(tag & 0xffffff) << 32) | (unsigned)fd;
+}
+
+UringPoller::UringPoller()
+	: ring_fd(-1), sq_ring(MAP_FAILED), sq_ring_size(0), cq_ring(MAP_FAILED), cq_ring_size(0),
+	  sqes((struct io_uring_sqe *)MAP_FAILED), sqes_size(0), sq_queued(0), completions(false),
+	  buffers((char *)MAP_FAILED), buffer_ring((struct io_uring_buf_ring *)MAP_FAILED),
+	  buffer_tail(0), sends_queued(0) {
+	struct io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_ENTRIES;
+#ifdef IORING_SETUP_COOP_TASKRUN
+	// No interrupting the worker to run completions, they are reaped on enter
+	params.flags |= IORING_SETUP_COOP_TASKRUN;
+	ring_fd = io_uring_setup(URING_SQ_ENTRIES, &params);
+	if (ring_fd < 0 && errno == EINVAL) {
+		params.flags &= ~IORING_SETUP_COOP_TASKRUN;
+		ring_fd = io_uring_setup(URING_SQ_ENTRIES, &params);
+	}
+#else
+	ring_fd = io_uring_setup(URING_SQ_ENTRIES, &params);
+#endif
+	if (ring_fd < 0)
+		return;
+	// Timed waits need EXT_ARG, and completions must never be dropped
+	if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)
+		|| !map_rings(params)) {
+		close(ring_fd);
+		ring_fd = -1;
+		return;
+	}
+	setup_buffers();
+}
+
+bool UringPoller::map_rings(const struct io_uring_params &params) {
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single)
+		sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		return false;
+	cq_ring = single ? sq_ring : mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	if (cq_ring == MAP_FAILED)
+		return false;
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe *)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return false;
+
+	char *sq = static_cast<char *>(sq_ring);
+	char *cq = static_cast<char *>(cq_ring);
+	sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	sq_entries = params.sq_entries;
+	cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+	// Slot i of the index array always points at sqes[i]
+	unsigned *array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	for (unsigned i = 0; i < sq_entries; i++)
+		array[i] = i;
+	sq_queued = *sq_tail;
+	return true;
+}
+
+// Without a buffer ring (before 5.19) the poller only reports readiness
+void UringPoller::setup_buffers() {
+	size_t ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+	buffer_ring = (struct io_uring_buf_ring *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	buffers = (char *)mmap(NULL, URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffer_ring == MAP_FAILED || buffers == MAP_FAILED)
+		return;
+
+	struct io_uring_buf_reg reg;
+	std::memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long long)(size_t)buffer_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return;
+	for (unsigned short buffer = 0; buffer < URING_BUFFERS; buffer++)
+		provide(buffer);
+	__atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+	completions = true;
+}
+
+// Queues a buffer for the kernel, published by the next store of the tail.
+// Entries are counted from the ring's start: in C++ the header's bufs[]
+// sits past an empty struct, 8 bytes off.
+void UringPoller::provide(unsigned short buffer) {
+	struct io_uring_buf *entry = reinterpret_cast<struct io_uring_buf *>(buffer_ring)
+		+ (buffer_tail & (URING_BUFFERS - 1));
+	entry->addr = (unsigned long long)(size_t)(buffers + (size_t)buffer * URING_BUFFER_SIZE);
+	entry->len = URING_BUFFER_SIZE;
+	entry->bid = buffer;
+	buffer_tail++;
+}
+
+UringPoller::~UringPoller() {
+	for (size_t i = 0; i < send_slots.size(); i++)
+		delete send_slots[i];
+	if (buffers != MAP_FAILED)
+		munmap(buffers, URING_BUFFERS * URING_BUFFER_SIZE);
+	if (buffer_ring != MAP_FAILED)
+		munmap(buffer_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqes_size);
+	if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	if (sq_ring != MAP_FAILED)
+		munmap(sq_ring, sq_ring_size);
+	if (ring_fd >= 0)
+		close(ring_fd);
+}
+
+bool UringPoller::valid() const {
+	return ring_fd >= 0;
+}
+
+const char *UringPoller::name() const {
+	return "uring";
+}
+
+// Publishes the queued entries and optionally waits, -1 with errno set
+// on failure. ETIME only means the timeout ran out.
+int UringPoller::enter(unsigned to_submit, unsigned min_complete, int timeout) {
+	__atomic_store_n(sq_tail, sq_queued, __ATOMIC_RELEASE);
+
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	std::memset(&arg, 0, sizeof(arg));
+	if (min_complete && timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		arg.ts = (unsigned long long)(size_t)&ts;
+	}
+	unsigned flags = IORING_ENTER_EXT_ARG | (min_complete ? IORING_ENTER_GETEVENTS : 0);
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, &arg, sizeof(arg));
+}
+
+// A free submission entry, pushing the queued ones out first if the ring
+// is full (a turn that changed more interests than it holds)
+struct io_uring_sqe *UringPoller::next_sqe() {
+	unsigned queued = sq_queued - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (queued == sq_entries) {
+		if (enter(queued, 0, 0) < 0)
+			return NULL;
+		if (sq_queued - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)
+			return NULL;
+	}
+	struct io_uring_sqe *sqe = &sqes[sq_queued & sq_mask];
+	std::memset(sqe, 0, sizeof(*sqe));
+	sq_queued++;
+	return sqe;
+}
+
+bool UringPoller::serves(int fd) const {
+	return completions && modes[fd] != READINESS;
+}
+
+// The readiness poll; while the fd is read its POLLIN is left out
+bool UringPoller::arm(int fd) {
+	struct io_uring_sqe *sqe = next_sqe();
+	if (!sqe)
+		return false;
+	short events = interest[fd];
+	if (serves(fd))
+		events &= ~POLLIN;
+	unsigned mask = to_epoll(events);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	mask = (mask << 16) | (mask >> 16); // The kernel swaps the halves back
+#endif
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = mask;
+	sqe->user_data = uring_data(URING_POLL, tags[fd], fd);
+	status[fd] = ARMED;
+	return true;
+}
+
+// Cancels the live poll; its completion then carries a stale tag
+void UringPoller::disarm(int fd) {
+	struct io_uring_sqe *sqe = next_sqe();
+	if (sqe) {
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = uring_data(URING_POLL, tags[fd], fd);
+		sqe->user_data = URING_IGNORED;
+	}
+	tags[fd]++;
+	status[fd] = IDLE;
+}
+
+// A multishot accept or recv, completing once per connection or per
+// filled buffer until it is cancelled or fails
+bool UringPoller::arm_read(int fd) {
+	struct io_uring_sqe *sqe = next_sqe();
+	if (!sqe)
+		return false;
+	sqe->fd = fd;
+	if (modes[fd] == ACCEPTS) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	} else {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUFFER_GROUP;
+	}
+	sqe->user_data = uring_data(URING_READ, serials[fd], fd);
+	reading[fd] = READING;
+	return true;
+}
+
+// What the read still completes is delivered, up to its final completion
+void UringPoller::cancel_read(int fd) {
+	struct io_uring_sqe *sqe = next_sqe();
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = uring_data(URING_READ, serials[fd], fd);
+	sqe->user_data = URING_IGNORED;
+	reading[fd] = CANCELLING;
+}
+
+// Brings the requests in line with the interest: served fds are read
+// while they want POLLIN and polled only for POLLOUT, the others polled
+// for everything. A poll reported last turn waits for the next wait.
+void UringPoller::update(int fd) {
+	bool read = serves(fd) && (interest[fd] & POLLIN);
+	if (read && reading[fd] == OFF && !arm_read(fd))
+		ended.push_back(fd);
+	else if (!read && reading[fd] == READING)
+		cancel_read(fd);
+
+	bool poll = !read || (interest[fd] & POLLOUT);
+	if (poll && status[fd] == IDLE && !arm(fd)) {
+		status[fd] = FIRED;
+		fired.push_back(fd);
+	} else if (!poll && status[fd] == ARMED)
+		disarm(fd);
+	else if (!poll && status[fd] == FIRED)
+		status[fd] = IDLE;
+}
+
+// The read's final completion: a listener or a paused fd is read again
+// when it wants to be, a stream that ended or failed is left for the
+// caller to close
+void UringPoller::read_ended(int fd, int result) {
+	bool failed = result == 0 || (result < 0 && result != -ENOBUFS && result != -ECANCELED);
+	if (failed && modes[fd] == READS) {
+		reading[fd] = ENDED;
+		return;
+	}
+	reading[fd] = OFF;
+	ended.push_back(fd); // Out of buffers, restarting now would fail again
+}
+
+bool UringPoller::add(int fd, short events) {
+	if (fd < 0)
+		return false;
+	if ((size_t)fd >= status.size()) {
+		interest.resize(fd + 1, 0);
+		status.resize(fd + 1, ABSENT);
+		reading.resize(fd + 1, OFF);
+		modes.resize(fd + 1, READINESS);
+		tags.resize(fd + 1, 0);
+		serials.resize(fd + 1, 0);
+	}
+	if (status[fd] != ABSENT)
+		return modify(fd, events);
+	interest[fd] = events;
+	status[fd] = IDLE;
+	reading[fd] = OFF;
+	modes[fd] = READINESS;
+	update(fd);
+	return status[fd] == ARMED;
+}
+
+bool UringPoller::modify(int fd, short events) {
+	if (fd < 0 || (size_t)fd >= status.size() || status[fd] == ABSENT)
+		return false;
+	if (interest[fd] == events)
+		return true;
+	interest[fd] = events;
+	if (status[fd] == ARMED)
+		disarm(fd);
+	update(fd);
+	return true;
+}
+
+// The requests hold a reference to the socket, so it is only really
+// closed once their cancellation reaches the kernel. Sends queued for it
+// are submitted right away: the caller may close the fd next, and the
+// number may be reused before the next wait.
+void UringPoller::remove(int fd) {
+	if (fd < 0 || (size_t)fd >= status.size() || status[fd] == ABSENT)
+		return;
+	if (status[fd] == ARMED)
+		disarm(fd);
+	if (reading[fd] == READING)
+		cancel_read(fd);
+	serials[fd]++;
+	status[fd] = ABSENT;
+	reading[fd] = OFF;
+	modes[fd] = READINESS;
+	if (sends_queued) {
+		unsigned queued = sq_queued - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		if (enter(queued, 0, 0) >= 0 && __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_queued)
+			sends_queued = 0;
+	}
+}
+
+bool UringPoller::serve_accepts(int fd) {
+	if (fd < 0 || (size_t)fd >= status.size() || status[fd] == ABSENT || !completions)
+		return false;
+	modes[fd] = ACCEPTS;
+	if (status[fd] == ARMED)
+		disarm(fd);
+	update(fd);
+	return true;
+}
+
+bool UringPoller::serve_reads(int fd) {
+	if (fd < 0 || (size_t)fd >= status.size() || status[fd] == ABSENT || !completions)
+		return false;
+	modes[fd] = READS;
+	if (status[fd] == ARMED)
+		disarm(fd);
+	update(fd);
+	return true;
+}
+
+// MSG_DONTWAIT runs the send inline when the entry is submitted and
+// completes it with whatever the socket took, so the data only has to
+// stay put until then and never waits in the kernel
+bool UringPoller::send(int fd, const struct iovec *iov, size_t count) {
+	if (fd < 0 || (size_t)fd >= status.size() || status[fd] == ABSENT || !serves(fd) || count == 0)
+		return false;
+	struct io_uring_sqe *sqe = next_sqe();
+	if (!sqe)
+		return false;
+	if (sends_queued == send_slots.size())
+		send_slots.push_back(new SendSlot);
+	SendSlot *slot = send_slots[sends_queued++];
+	slot->iov.assign(iov, iov + count);
+	std::memset(&slot->msg, 0, sizeof(slot->msg));
+	slot->msg.msg_iov = &slot->iov[0];
+	slot->msg.msg_iovlen = count;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long)(size_t)&slot->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+	sqe->user_data = uring_data(URING_SEND, serials[fd], fd);
+	return true;
+}
+
+bool UringPoller::current(const PollEvent &event) const {
+	if (event.kind == POLL_READY)
+		return true;
+	return event.fd >= 0 && (size_t)event.fd < serials.size() && event.serial == serials[event.fd];
+}
+
+// Turns the completion ring into events. Completions of removed fds are
+// dropped here, except for data already handed out: current() tells
+// those apart once the caller has removed the fd itself.
+void UringPoller::reap(std::vector<PollEvent> &ready) {
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		const struct io_uring_cqe &cqe = cqes[head & cq_mask];
+		if (cqe.user_data == URING_IGNORED)
+			continue;
+		UringOp op = (UringOp)(cqe.user_data >> 56);
+		unsigned tag = (unsigned)(cqe.user_data >> 32) & 0xffffff;
+		int fd = (int)(cqe.user_data & 0xffffffffu);
+		if (op == URING_READ && (cqe.flags & IORING_CQE_F_BUFFER))
+			consumed.push_back(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		if ((size_t)fd >= status.size() || status[fd] == ABSENT)
+			continue;
+
+		PollEvent event;
+		event.fd = fd;
+		event.serial = serials[fd];
+		if (op == URING_POLL) {
+			if (status[fd] != ARMED || (tags[fd] & 0xffffff) != tag)
+				continue; // Changed since
+			status[fd] = FIRED;
+			fired.push_back(fd);
+			event.events = cqe.res < 0 ? POLLERR : from_epoll(cqe.res);
+			// A read still running reports the hangup itself, after the data
+			if (reading[fd] == READING || reading[fd] == CANCELLING)
+				event.events &= POLLOUT;
+			if (event.events)
+				ready.push_back(event);
+			continue;
+		}
+		if ((serials[fd] & 0xffffff) != tag)
+			continue;
+		if (op == URING_SEND) {
+			event.kind = POLL_SENT;
+			event.result = cqe.res;
+			ready.push_back(event);
+			continue;
+		}
+		if (cqe.res == -EINVAL) {
+			// No multishot support, this fd and the next go back to readiness
+			completions = false;
+			modes[fd] = READINESS;
+			reading[fd] = OFF;
+			update(fd);
+			continue;
+		}
+		if (!(cqe.flags & IORING_CQE_F_MORE))
+			read_ended(fd, cqe.res);
+		if (cqe.res == -ENOBUFS || cqe.res == -ECANCELED)
+			continue;
+		event.kind = modes[fd] == ACCEPTS ? POLL_ACCEPTED : POLL_RECEIVED;
+		event.result = cqe.res;
+		if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER))
+			event.data = buffers + (size_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUFFER_SIZE;
+		ready.push_back(event);
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+static bool is_send(const PollEvent &event) {
+	return event.kind == POLL_SENT;
+}
+
+int UringPoller::wait(std::vector<PollEvent> &ready, int timeout) {
+	ready.clear();
+	// The data handed out last turn has been consumed
+	for (size_t i = 0; i < consumed.size(); i++)
+		provide(consumed[i]);
+	if (!consumed.empty())
+		__atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+	consumed.clear();
+	size_t count = fired.size(); // Whatever fails to re-arm is pushed again
+	for (size_t i = 0; i < count; i++) {
+		if (status[fired[i]] == FIRED) {
+			status[fired[i]] = IDLE;
+			update(fired[i]);
+		}
+	}
+	fired.erase(fired.begin(), fired.begin() + count);
+	count = ended.size();
+	for (size_t i = 0; i < count; i++) {
+		if (status[ended[i]] != ABSENT && reading[ended[i]] == OFF)
+			update(ended[i]);
+	}
+	ended.erase(ended.begin(), ended.begin() + count);
+
+	bool waiting = timeout != 0 && *cq_head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	unsigned queued = sq_queued - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	int result = enter(queued, waiting ? 1 : 0, timeout);
+	if (result < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+		return -1;
+	int saved_errno = errno;
+	if (__atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_queued)
+		sends_queued = 0;
+
+	reap(ready);
+	// Sends first: until its completion is seen a client's output can only pile up
+	std::stable_partition(ready.begin(), ready.end(), is_send);
+	if (ready.empty() && result < 0 && saved_errno == EINTR) {
+		errno = EINTR;
+		return -1;
+	}
+	return ready.size();
+}
+
+// Cancels every read and waits for their final completions, so no
+// connection is accepted or data taken off a socket after this returns.
+// Reads the caller starts meanwhile, for connections it gets here, are
+// cancelled in the next round.
+void UringPoller::drain(std::vector<PollEvent> &done) {
+	for (int round = 0; round < URING_DRAIN_ROUNDS; round++) {
+		for (size_t fd = 0; fd < reading.size(); fd++) {
+			if (status[fd] != ABSENT && reading[fd] == READING)
+				cancel_read(fd);
+		}
+		if (std::find(reading.begin(), reading.end(), (unsigned char)CANCELLING) == reading.end()
+			&& sq_queued == __atomic_load_n(sq_head, __ATOMIC_ACQUIRE))
+			break;
+		unsigned queued = sq_queued - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		if (enter(queued, 1, 100) < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+			break;
+		if (__atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_queued)
+			sends_queued = 0;
+		reap(done);
+	}
+}
+
+#endif
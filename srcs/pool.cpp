@@ -0,0 +1,144 @@
+#include "../pool.hpp"
+
+#include <cstdlib>
+#include <pthread.h>
+
+struct FreeBlock {
+	FreeBlock *next;
+};
+
+struct ThreadCache {
+	FreeBlock *blocks[POOL_CLASSES];
+	size_t count[POOL_CLASSES];
+};
+
+// Blocks handed back by threads with too many, or that exited
+static FreeBlock *depot[POOL_CLASSES];
+static pthread_mutex_t depot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread ThreadCache *thread_cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static size_t block_size(int size_class) {
+	return (size_t)POOL_MIN_BLOCK << size_class;
+}
+
+static int size_class(size_t size) {
+	int size_class = 0;
+	while (size_class < POOL_CLASSES && block_size(size_class) < size)
+		size_class++;
+	return size_class;
+}
+
+// Moves up to `count` blocks from one list to another, returns how many
+static size_t move_blocks(FreeBlock *&from, FreeBlock *&to, size_t count) {
+	size_t moved = 0;
+	while (from && moved < count) {
+		FreeBlock *block = from;
+		from = block->next;
+		block->next = to;
+		to = block;
+		moved++;
+	}
+	return moved;
+}
+
+// A finished thread's blocks stay in the process for the others to use
+static void retire_cache(void *data) {
+	ThreadCache *cache = static_cast<ThreadCache *>(data);
+	pthread_mutex_lock(&depot_mutex);
+	for (int i = 0; i < POOL_CLASSES; i++)
+		move_blocks(cache->blocks[i], depot[i], cache->count[i]);
+	pthread_mutex_unlock(&depot_mutex);
+	delete cache;
+}
+
+static void create_cache_key() {
+	pthread_key_create(&cache_key, &retire_cache);
+}
+
+static ThreadCache &local_cache() {
+	if (!thread_cache) {
+		pthread_once(&cache_once, &create_cache_key);
+		thread_cache = new ThreadCache();
+		pthread_setspecific(cache_key, thread_cache);
+	}
+	return *thread_cache;
+}
+
+void *pool_allocate(size_t size) {
+	int size_class = ::size_class(size);
+	if (size_class == POOL_CLASSES)
+		return ::operator new(size);
+
+	ThreadCache &cache = local_cache();
+	if (!cache.blocks[size_class]) {
+		pthread_mutex_lock(&depot_mutex);
+		size_t moved = move_blocks(depot[size_class], cache.blocks[size_class], POOL_BATCH);
+		pthread_mutex_unlock(&depot_mutex);
+		cache.count[size_class] += moved;
+		if (!moved)
+			return ::operator new(block_size(size_class));
+	}
+	FreeBlock *block = cache.blocks[size_class];
+	cache.blocks[size_class] = block->next;
+	cache.count[size_class]--;
+	return block;
+}
+
+// Blocks freed by another thread than the one that took them (a buffer
+// released by the last worker to send it) simply change caches
+void pool_release(void *block, size_t size) {
+	int size_class = ::size_class(size);
+	if (size_class == POOL_CLASSES) {
+		::operator delete(block);
+		return;
+	}
+
+	ThreadCache &cache = local_cache();
+	FreeBlock *freed = static_cast<FreeBlock *>(block);
+	freed->next = cache.blocks[size_class];
+	cache.blocks[size_class] = freed;
+	if (++cache.count[size_class] > POOL_CACHE_LIMIT) {
+		pthread_mutex_lock(&depot_mutex);
+		cache.count[size_class] -= move_blocks(cache.blocks[size_class], depot[size_class], POOL_BATCH);
+		pthread_mutex_unlock(&depot_mutex);
+	}
+}
+
+#ifdef COUNT_ALLOCATIONS
+
+static unsigned long long allocations;
+
+long long allocation_count() {
+	return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+void *operator new(size_t size) throw(std::bad_alloc) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	void *block = std::malloc(size ? size : 1);
+	if (!block)
+		throw std::bad_alloc();
+	return block;
+}
+
+void *operator new[](size_t size) throw(std::bad_alloc) {
+	return operator new(size);
+}
+
+void operator delete(void *block) throw() {
+	std::free(block);
+}
+
+void operator delete[](void *block) throw() {
+	std::free(block);
+}
+
+#else
+
+long long allocation_count() {
+	return -1;
+}
+
+#endif
@@ -0,0 +1,72 @@
+#include "../stats.hpp"
+
+#include <ctime>
+
+Histogram::Histogram() : count(0), sum(0), max(0) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		buckets[i] = 0;
+}
+
+void Histogram::record(unsigned long long value) {
+	int bucket = value ? 64 - __builtin_clzll(value) : 0;
+	if (bucket >= HISTOGRAM_BUCKETS)
+		bucket = HISTOGRAM_BUCKETS - 1;
+	stat_add(buckets[bucket], 1);
+	stat_add(count, 1);
+	stat_add(sum, value);
+	if (value > stat_load(max))
+		__atomic_store_n(&max, value, __ATOMIC_RELAXED);
+}
+
+void Histogram::merge(const Histogram &other) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		buckets[i] += stat_load(other.buckets[i]);
+	count += stat_load(other.count);
+	sum += stat_load(other.sum);
+	if (stat_load(other.max) > max)
+		max = stat_load(other.max);
+}
+
+// Upper bound of the bucket holding the requested rank, capped at max
+unsigned long long Histogram::percentile(double fraction) const {
+	if (count == 0)
+		return 0;
+	unsigned long long rank = (unsigned long long)(fraction * count);
+	unsigned long long seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen > rank) {
+			unsigned long long bound = i ? (1ULL << i) - 1 : 0;
+			return bound < max ? bound : max;
+		}
+	}
+	return max;
+}
+
+Stats::Stats()
+	: bytes_in(0), bytes_out(0), messages_out(0), sends(0), accepted(0), disconnected(0), wakeups(0) {
+	for (int i = 0; i < MAX_COMMANDS; i++)
+		command_calls[i] = 0;
+}
+
+void Stats::merge(const Stats &other) {
+	for (int i = 0; i < MAX_COMMANDS; i++) {
+		command_calls[i] += stat_load(other.command_calls[i]);
+		command_ns[i].merge(other.command_ns[i]);
+	}
+	bytes_in += stat_load(other.bytes_in);
+	bytes_out += stat_load(other.bytes_out);
+	messages_out += stat_load(other.messages_out);
+	sends += stat_load(other.sends);
+	accepted += stat_load(other.accepted);
+	disconnected += stat_load(other.disconnected);
+	wakeups += stat_load(other.wakeups);
+	ready_per_wakeup.merge(other.ready_per_wakeup);
+	fanout.merge(other.fanout);
+}
+
+unsigned long long monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,93 @@
+#include "../timer_wheel.hpp"
+
+#include <cstddef>
+
+Timer::Timer() : prev(NULL), next(NULL), expires(0), wheel(NULL), id(-1) {}
+
+bool Timer::armed() const {
+	return wheel != NULL;
+}
+
+void Timer::cancel() {
+	if (!wheel)
+		return;
+	prev->next = next;
+	next->prev = prev;
+	prev = next = NULL;
+	wheel->count--;
+	wheel = NULL;
+}
+
+TimerWheel::TimerWheel(unsigned long long now) : current(now), count(0) {
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		for (int slot = 0; slot < TIMER_SLOTS; slot++)
+			slots[level][slot].prev = slots[level][slot].next = &slots[level][slot];
+	}
+}
+
+// The level is picked by distance, the slot by the deadline's own bits at
+// that level, so a slot is reached exactly when its span begins
+void TimerWheel::place(Timer &timer) {
+	unsigned long long span = 1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS);
+	if (timer.expires - current >= span)
+		timer.expires = current + span - 1;
+	unsigned long long delta = timer.expires - current;
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_SLOT_BITS * (level + 1))))
+		level++;
+
+	Timer &head = slots[level][(timer.expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+	timer.prev = head.prev;
+	timer.next = &head;
+	head.prev->next = &timer;
+	head.prev = &timer;
+}
+
+void TimerWheel::cascade(int level, size_t slot) {
+	Timer &head = slots[level][slot];
+	Timer *timer = head.next;
+	head.prev = head.next = &head;
+	while (timer != &head) {
+		Timer *next = timer->next;
+		place(*timer);
+		timer = next;
+	}
+}
+
+// Deadlines in the past fire on the next tick
+void TimerWheel::arm(Timer &timer, unsigned long long expires) {
+	timer.cancel();
+	timer.expires = expires > current ? expires : current + 1;
+	timer.wheel = this;
+	count++;
+	place(timer);
+}
+
+// Moves time forward, unlinking whatever falls due and reporting its id
+void TimerWheel::advance(unsigned long long now, std::vector<int> &expired) {
+	while (current < now) {
+		current++;
+		size_t index = current & (TIMER_SLOTS - 1);
+		for (int level = 1; index == 0 && level < TIMER_LEVELS; level++) {
+			size_t slot = (current >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+			cascade(level, slot);
+			if (slot != 0)
+				break;
+		}
+
+		Timer &head = slots[0][index];
+		while (head.next != &head) {
+			Timer *timer = head.next;
+			expired.push_back(timer->id);
+			timer->cancel();
+		}
+	}
+}
+
+unsigned long long TimerWheel::now() const {
+	return current;
+}
+
+size_t TimerWheel::size() const {
+	return count;
+}
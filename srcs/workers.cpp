@@ -0,0 +1,308 @@
+#include "../ircserv.hpp"
+
+#include <sys/resource.h>
+#include <fstream>
+#include <cstdio>
+
+#define MAX_SLAB_SIZE (1 << 20)
+
+ServerState::ServerState(const std::string &password, const ServerConfig &config)
+	: password(password), config(config), history(config.history_lines, config.history_memory),
+	  started(monotonic_ns()), connections(0), handoff_connection(-1), next_uid(0) {
+	pthread_rwlock_init(&lock, NULL);
+
+	// Take every descriptor the hard limit allows, the default soft limit
+	// (often 1024) is far below what a busy server needs
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != limit.rlim_max) {
+		limit.rlim_cur = (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > MAX_SLAB_SIZE)
+			? MAX_SLAB_SIZE : limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	// The slab never grows once workers run, so size it for every possible fd
+	size_t slots = 1024;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+		slots = (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > MAX_SLAB_SIZE)
+			? MAX_SLAB_SIZE : limit.rlim_cur;
+	remote_base = slots;
+	clients.assign(slots + MAX_REMOTE_USERS, (Client *)NULL);
+	for (size_t slot = clients.size(); slot > remote_base; slot--)
+		remote_free.push_back(slot - 1);
+}
+
+ServerState::~ServerState() {
+	for (size_t i = 0; i < workers.size(); i++)
+		delete workers[i];
+	for (size_t i = 0; i < clients.size(); i++)
+		delete clients[i];
+	for (ChannelDirectory::iterator it = directory.begin(); it != directory.end(); ++it)
+		delete it->second;
+	pthread_rwlock_destroy(&lock);
+}
+
+StateLock::StateLock(ServerState &state, Mode mode)
+	: lock(mode == NONE ? NULL : &state.lock) {
+	if (mode == READ)
+		pthread_rwlock_rdlock(lock);
+	else if (mode == WRITE)
+		pthread_rwlock_wrlock(lock);
+}
+
+StateLock::~StateLock() {
+	if (lock)
+		pthread_rwlock_unlock(lock);
+}
+
+// Mailboxes
+
+void IRCServer::post(int worker, const Delivery &delivery) {
+	// Keep ordering: once something overflowed, everything after it waits too
+	if (!overflow[worker].empty() || !state.workers[worker]->inbox[worker_id]->push(delivery))
+		overflow[worker].push_back(delivery);
+	posted[worker] = true;
+}
+
+// Moves overflow into the mailboxes and pokes every worker that got mail.
+// Returns true while some mail is still waiting for room.
+bool IRCServer::wake_workers() {
+	bool pending = false;
+	for (size_t worker = 0; worker < posted.size(); worker++) {
+		if (!posted[worker])
+			continue;
+		std::deque<Delivery> &waiting = overflow[worker];
+		Mailbox *mailbox = state.workers[worker]->inbox[worker_id];
+		while (!waiting.empty() && mailbox->push(waiting.front()))
+			waiting.pop_front();
+		state.workers[worker]->wake();
+		posted[worker] = !waiting.empty();
+		pending = pending || posted[worker];
+	}
+	return pending;
+}
+
+void IRCServer::wake() {
+	char byte = 0;
+	ssize_t written = write(wakeup_pipe[1], &byte, 1);
+	(void)written; // A full pipe already means a pending wakeup
+}
+
+void IRCServer::deliver_mail() {
+	Delivery delivery;
+	for (size_t worker = 0; worker < inbox.size(); worker++) {
+		while (inbox[worker] && inbox[worker]->pop(delivery)) {
+			BufferRef message(delivery.buffer);
+			Client *client = clients[delivery.client_socket];
+			// The client may have left, or its fd may belong to a newer connection
+			if (client->owner() == worker_id && client->current_generation() == delivery.generation)
+				send_to_client(delivery.client_socket, message);
+		}
+	}
+}
+
+// Metrics
+
+const Stats &IRCServer::statistics() const {
+	return stats;
+}
+
+void IRCServer::collect_stats(Stats &total) {
+	for (size_t i = 0; i < state.workers.size(); i++)
+		total.merge(state.workers[i]->statistics());
+}
+
+// Mail that did not fit in a full mailbox is retried shortly, backlogged
+// clients are resumed once they earn a token, listings go on as soon as
+// their client has room, and worker 0 also wakes up
+// to reconnect lost links and in time for the next stats dump
+int IRCServer::poll_timeout() {
+	int timeout = wake_workers() ? 1 : backlog_timeout();
+	int ticking = timer_timeout();
+	if (ticking != -1 && (timeout == -1 || ticking < timeout))
+		timeout = ticking;
+	int linking = link_timeout();
+	if (linking != -1 && (timeout == -1 || linking < timeout))
+		timeout = linking;
+	if (listing_timeout() == 0)
+		timeout = 0;
+	int capturing = capture_timeout();
+	if (capturing != -1 && (timeout == -1 || capturing < timeout))
+		timeout = capturing;
+	if (worker_id != 0 || config.stats_file.empty())
+		return timeout;
+
+	unsigned long long now = monotonic_ns();
+	if (now >= next_stats_dump) {
+		dump_stats();
+		next_stats_dump = now + config.stats_interval * 1000000000ULL;
+	}
+	int until = (next_stats_dump - now) / 1000000 + 1;
+	return (timeout == -1 || until < timeout) ? until : timeout;
+}
+
+// Trace records go out in large writes, but never sit longer than
+// CAPTURE_FLUSH_MS so a trace cut short by a crash is still useful
+void IRCServer::flush_capture(bool force) {
+	if (capture_batch.empty())
+		return;
+	if (force || capture_batch.size() >= CAPTURE_FLUSH_BYTES
+		|| monotonic_ns() - capture_since >= CAPTURE_FLUSH_MS * 1000000ULL) {
+		capture_write(capture_batch);
+		capture_since = 0;
+	}
+}
+
+int IRCServer::capture_timeout() {
+	if (capture_batch.empty())
+		return -1;
+	unsigned long long age = (monotonic_ns() - capture_since) / 1000000;
+	return age >= CAPTURE_FLUSH_MS ? 0 : CAPTURE_FLUSH_MS - age;
+}
+
+static void dump_histogram(std::ostream &out, const std::string &name, const Histogram &histogram) {
+	out << name << ".count " << histogram.count << "\n"
+		<< name << ".sum " << histogram.sum << "\n"
+		<< name << ".p50 " << histogram.percentile(0.50) << "\n"
+		<< name << ".p99 " << histogram.percentile(0.99) << "\n"
+		<< name << ".max " << histogram.max << "\n";
+}
+
+// One "name value" pair per line. Written aside and renamed into place so
+// readers never see a partial file.
+void IRCServer::dump_stats() {
+	Stats total;
+	collect_stats(total);
+	size_t channel_count;
+	{
+		StateLock guard(state, StateLock::READ);
+		channel_count = channels.size();
+	}
+
+	std::string partial = config.stats_file + ".tmp";
+	std::ofstream out(partial.c_str());
+	out << "uptime_seconds " << (monotonic_ns() - state.started) / 1000000000ULL << "\n"
+		<< "workers " << config.workers << "\n"
+		<< "clients " << total.accepted - total.disconnected << "\n"
+		<< "channels " << channel_count << "\n"
+		<< "accepted " << total.accepted << "\n"
+		<< "bytes_in " << total.bytes_in << "\n"
+		<< "bytes_out " << total.bytes_out << "\n"
+		<< "messages_out " << total.messages_out << "\n"
+		<< "sends " << total.sends << "\n"
+		<< "wakeups " << total.wakeups << "\n"
+		<< "log_dropped " << log_dropped() << "\n";
+	if (allocation_count() >= 0)
+		out << "allocations " << allocation_count() << "\n";
+	dump_histogram(out, "ready_per_wakeup", total.ready_per_wakeup);
+	dump_histogram(out, "fanout", total.fanout);
+	for (size_t i = 0; i < MAX_COMMANDS; i++) {
+		if (total.command_calls[i] == 0)
+			continue;
+		std::string verb = i < command_count ? command_table[i].name : "unknown";
+		out << "command." << verb << ".calls " << total.command_calls[i] << "\n";
+		dump_histogram(out, "command." + verb + ".ns", total.command_ns[i]);
+	}
+	for (size_t i = 0; i < state.workers.size(); i++) {
+		const Stats &worker = state.workers[i]->statistics();
+		out << "worker." << i << ".clients " << stat_load(worker.accepted) - stat_load(worker.disconnected) << "\n"
+			<< "worker." << i << ".wakeups " << stat_load(worker.wakeups) << "\n"
+			<< "worker." << i << ".bytes_in " << stat_load(worker.bytes_in) << "\n"
+			<< "worker." << i << ".bytes_out " << stat_load(worker.bytes_out) << "\n";
+	}
+	out.close();
+	if (!out || std::rename(partial.c_str(), config.stats_file.c_str()) != 0)
+		log_write(LOG_ERROR, "stats_write_failed path=%s", config.stats_file.c_str());
+}
+
+static void *run_worker(void *worker) {
+	static_cast<IRCServer *>(worker)->start();
+	return NULL;
+}
+
+// Runs every worker until shutdown or a handoff request stops them
+static void run_workers(ServerState &state) {
+	int workers = state.config.workers;
+
+	// Only the main thread takes SIGINT, it then wakes the other workers
+	sigset_t signals, previous;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &signals, &previous);
+	std::vector<pthread_t> threads(workers);
+	for (int i = 1; i < workers; i++) {
+		if (pthread_create(&threads[i], NULL, &run_worker, state.workers[i]) != 0) {
+			std::cerr << "Error: Cannot start worker thread" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+	state.workers[0]->start();
+
+	live = false;
+	for (int i = 1; i < workers; i++)
+		state.workers[i]->wake();
+	for (int i = 1; i < workers; i++)
+		pthread_join(threads[i], NULL);
+}
+
+// Serves until shutdown or a completed handoff
+static int serve(int port, const std::string &password, const ServerConfig &config) {
+	ServerState state(password, config);
+
+	std::vector<int> listeners;
+	int predecessor = -1;
+	if (!config.takeover.empty()) {
+		predecessor = receive_handoff(state, config.takeover, listeners);
+		if (predecessor < 0) {
+			log_write(LOG_ERROR, "takeover_failed path=%s", config.takeover.c_str());
+			return 1;
+		}
+	}
+	for (int i = 0; i < config.workers; i++)
+		state.workers.push_back(new IRCServer(state, i, port, i < (int)listeners.size() ? listeners[i] : -1));
+	for (size_t i = config.workers; i < listeners.size(); i++)
+		close(listeners[i]);
+	if (predecessor >= 0) {
+		for (int i = 0; i < config.workers; i++)
+			state.workers[i]->adopt_clients();
+		char ack = 1;
+		ssize_t written = write(predecessor, &ack, 1);
+		(void)written; // Should the predecessor be gone, we serve on regardless
+		close(predecessor);
+		log_write(LOG_INFO, "takeover clients=%lu", (unsigned long)state.connections);
+	}
+
+	while (true) {
+		run_workers(state);
+		if (state.handoff_connection < 0)
+			break;
+		bool handed_off = send_handoff(state, state.handoff_connection);
+		close(state.handoff_connection);
+		state.handoff_connection = -1;
+		if (handed_off) {
+			log_write(LOG_INFO, "handoff_complete");
+			break;
+		}
+		log_write(LOG_ERROR, "handoff_failed reason=\"resuming service\"");
+		live = true;
+	}
+	return 0;
+}
+
+int run_server(int port, const std::string &password, const ServerConfig &config) {
+	if (!log_open(config.log_file, config.log_level)) {
+		std::cerr << "Error: Cannot open log file " << config.log_file << std::endl;
+		return 1;
+	}
+	if (!capture_open(config.capture_file)) {
+		std::cerr << "Error: Cannot open capture file " << config.capture_file << std::endl;
+		log_close();
+		return 1;
+	}
+	int status = serve(port, password, config);
+	capture_close();
+	log_close();
+	return status;
+}
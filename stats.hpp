@@ -0,0 +1,49 @@
+#ifndef STATS_HPP
+# define STATS_HPP
+
+# define HISTOGRAM_BUCKETS 64
+# define MAX_COMMANDS 32 // Command table entries, the last slot counts unknown verbs
+
+// Counters are written by one worker and read by whoever aggregates
+// them, so updates are relaxed atomic stores: no lock prefix, no tearing.
+inline void stat_add(unsigned long long &counter, unsigned long long value) {
+	__atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+inline unsigned long long stat_load(const unsigned long long &counter) {
+	return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
+
+// Log2-bucketed histogram: bucket i counts values in [2^(i-1), 2^i)
+struct Histogram {
+	unsigned long long buckets[HISTOGRAM_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+
+	Histogram();
+	void record(unsigned long long value);
+	void merge(const Histogram &other);
+	unsigned long long percentile(double fraction) const;
+};
+
+struct Stats {
+	unsigned long long command_calls[MAX_COMMANDS];
+	Histogram command_ns[MAX_COMMANDS];
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long long messages_out; // Messages queued to clients
+	unsigned long long sends;        // sendmsg calls
+	unsigned long long accepted;
+	unsigned long long disconnected;
+	unsigned long long wakeups;
+	Histogram ready_per_wakeup;
+	Histogram fanout; // Recipients per send_to_channel
+
+	Stats();
+	void merge(const Stats &other);
+};
+
+unsigned long long monotonic_ns();
+
+#endif // STATS_HPP
@@ -0,0 +1,27 @@
+#ifndef STRING_VIEW_HPP
+# define STRING_VIEW_HPP
+
+# include <string>
+# include <cstddef>
+# include <cstring>
+
+// Non-owning view into bytes that live elsewhere (usually an input buffer)
+struct StringView {
+	const char *data;
+	size_t size;
+
+	StringView() : data(""), size(0) {}
+	StringView(const char *data, size_t size) : data(data), size(size) {}
+	explicit StringView(const std::string &text) : data(text.data()), size(text.size()) {}
+
+	bool empty() const { return size == 0; }
+	std::string str() const { return std::string(data, size); }
+};
+
+// Byte order, the same as std::string's, so views can key an ordered map
+inline bool operator<(const StringView &left, const StringView &right) {
+	int order = std::memcmp(left.data, right.data, left.size < right.size ? left.size : right.size);
+	return order < 0 || (order == 0 && left.size < right.size);
+}
+
+#endif // STRING_VIEW_HPP
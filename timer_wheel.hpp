@@ -0,0 +1,55 @@
+#ifndef TIMER_WHEEL_HPP
+# define TIMER_WHEEL_HPP
+
+# include <vector>
+# include <cstddef>
+
+# define TIMER_LEVELS 4
+# define TIMER_SLOT_BITS 6
+# define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+# define TIMER_TICK_MS 1000 // Deadlines are whole seconds
+
+class TimerWheel;
+
+// Intrusive list node, embedded in whatever owns the deadline. Cancelling
+// only unlinks it, so it costs the same whatever the number of timers.
+struct Timer {
+	Timer *prev;
+	Timer *next;
+	unsigned long long expires; // Tick
+	TimerWheel *wheel;          // Set while armed
+	int id;                     // Reported back when it fires
+
+	Timer();
+	bool armed() const;
+	void cancel();
+};
+
+// Hierarchical timing wheel: level 0 has one slot per tick, each level
+// above covers TIMER_SLOTS times the span of the one below and is
+// cascaded down as time reaches it. Arm and cancel are O(1), advancing is
+// O(1) per tick plus the timers that fire or cascade.
+class TimerWheel {
+	private:
+		Timer slots[TIMER_LEVELS][TIMER_SLOTS]; // List heads
+		unsigned long long current;             // Last tick processed
+		size_t count;
+
+		TimerWheel(const TimerWheel &);
+		TimerWheel &operator=(const TimerWheel &);
+
+		void place(Timer &timer);
+		void cascade(int level, size_t slot);
+
+	public:
+		explicit TimerWheel(unsigned long long now);
+
+		void arm(Timer &timer, unsigned long long expires);
+		void advance(unsigned long long now, std::vector<int> &expired);
+		unsigned long long now() const;
+		size_t size() const;
+
+		friend struct Timer;
+};
+
+#endif // TIMER_WHEEL_HPP